@@ -134,6 +134,221 @@ SELECT reset_user('secret');
 
 RESET SESSION AUTHORIZATION;
 
+-- test DISCARD ALL
+SET SESSION AUTHORIZATION dba;
+SELECT set_user('bob');
+SELECT SESSION_USER, CURRENT_USER;
+DISCARD ALL;
+SELECT SESSION_USER, CURRENT_USER;
+SELECT reset_user();
+SET SESSION AUTHORIZATION dba;
+SELECT set_user('bob', 'secret');
+DISCARD ALL; -- should fail
+SELECT reset_user('secret');
+RESET SESSION AUTHORIZATION;
+
+-- test set_session_auth with reset token
+SELECT set_session_auth('bob', 'pooltoken');
+SELECT SESSION_USER, CURRENT_USER;
+SELECT reset_session_auth('pooltoken');
+SELECT SESSION_USER, CURRENT_USER;
+
+-- rate limiting is off by default, so nothing has been refused
+SELECT * FROM set_user_rate_limit_stats();
+
+-- jobs are only accepted in set_user.job_database, which this is not
+SELECT set_user_submit_job(current_database(), 'bob', 'VACUUM'); -- should fail
+SELECT count(*) FROM set_user_job_queue;
+
+-- test escalation leases
+SELECT set_user_create_lease('bob', '1 hour') AS lease \gset
+SELECT set_user_attach_lease(:'lease');
+SELECT SESSION_USER, CURRENT_USER;
+SELECT reset_user();
+SELECT set_user_attach_lease('0123456789abcdef0123456789abcdef');
+
+-- test bulk policy checks
+SELECT * FROM set_user_check(ARRAY['dba', 'bob', 'dba', 'nobody'],
+                             ARRAY['postgres', 'postgres', 'joe', 'bob']);
+
+-- in a multi-statement query, transitions take effect at statement boundaries
+CREATE TABLE whoami (stmt int, session_role name, acting_role name);
+GRANT INSERT ON whoami TO PUBLIC;
+DO $$BEGIN PERFORM set_user('bob'); END$$ \; INSERT INTO whoami SELECT 1, SESSION_USER, CURRENT_USER \; DO $$BEGIN PERFORM reset_user(); END$$ \; INSERT INTO whoami SELECT 2, SESSION_USER, CURRENT_USER;
+SELECT * FROM whoami ORDER BY stmt;
+DROP TABLE whoami;
+-- and are undone if a later statement fails
+DO $$BEGIN PERFORM set_user('bob'); END$$ \; SELECT 1/0;
+SELECT SESSION_USER, CURRENT_USER;
+
+-- set_user() is refused in explicit blocks, including chained ones
+BEGIN;
+SELECT set_user('bob'); -- should fail
+ROLLBACK AND CHAIN;
+SELECT set_user('bob'); -- should fail
+COMMIT AND CHAIN;
+SELECT set_user('bob'); -- should fail
+ROLLBACK;
+
+-- the blocked function scan does not keep function bodies in backend memory
+DO $$
+BEGIN
+  FOR i IN 1..200 LOOP
+    EXECUTE format('CREATE FUNCTION big_body_%s() RETURNS text LANGUAGE sql AS %L',
+                   i, 'SELECT ' || quote_literal(repeat('x', 100000)));
+  END LOOP;
+END
+$$;
+\c -
+DO $$
+BEGIN
+  IF current_setting('server_version_num')::int >= 140000 THEN
+    PERFORM set_config('set_user_test.mem_before',
+                       (SELECT sum(total_bytes) FROM pg_backend_memory_contexts)::text,
+                       false);
+  END IF;
+END
+$$;
+-- the first call while transitioned scans pg_proc
+SELECT set_user('bob');
+SELECT reset_user();
+DO $$
+BEGIN
+  -- pg_backend_memory_contexts is new in PostgreSQL 14
+  IF current_setting('server_version_num')::int >= 140000 THEN
+    IF (SELECT sum(total_bytes) FROM pg_backend_memory_contexts) -
+       current_setting('set_user_test.mem_before')::bigint > 4 * 1024 * 1024 THEN
+      RAISE EXCEPTION 'backend memory grew while scanning pg_proc';
+    END IF;
+  END IF;
+END
+$$;
+DO $$
+BEGIN
+  FOR i IN 1..200 LOOP
+    EXECUTE format('DROP FUNCTION big_body_%s()', i);
+  END LOOP;
+END
+$$;
+
+-- the set_user state is reported to clients as read-only settings
+SHOW set_user.active;
+SELECT set_user('bob');
+SELECT current_setting('set_user.active') AS active,
+       current_setting('set_user.target_role') AS target_role,
+       current_setting('set_user.elevated') AS elevated;
+SELECT reset_user();
+SET SESSION AUTHORIZATION dba;
+SELECT set_user_u('postgres');
+SELECT current_setting('set_user.active') AS active,
+       current_setting('set_user.target_role') AS target_role,
+       current_setting('set_user.elevated') AS elevated;
+SELECT reset_user();
+RESET SESSION AUTHORIZATION;
+SHOW set_user.target_role;
+SET set_user.active = on; -- should fail
+
+-- an allowlist mixing role names and the wildcard is rejected
+ALTER SYSTEM SET set_user.superuser_allowlist = 'dba,*'; -- should fail
+ALTER SYSTEM SET set_user.nosuperuser_target_allowlist = '+'; -- should fail
+
+
+-- transitions, and DDL run while transitioned, are written to set_user_audit_log
+ALTER SYSTEM SET set_user.audit_table = on;
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);
+SHOW set_user.audit_table;
+SET SESSION AUTHORIZATION dba;
+SELECT set_user_u('postgres');
+CREATE TABLE audited (id int);
+DROP TABLE audited;
+SELECT reset_user();
+RESET SESSION AUTHORIZATION;
+SELECT session_role, acting_role, event_type, target_role, command_tag
+  FROM set_user_audit_log ORDER BY event_time;
+-- events of read-only transactions wait for the next read-write one
+SET default_transaction_read_only = on;
+SELECT set_user('bob');
+SELECT reset_user();
+SET default_transaction_read_only = off;
+SELECT count(*) FROM set_user_audit_log WHERE target_role = 'bob';
+SELECT count(*) FROM set_user_audit_log WHERE target_role = 'bob';
+-- and at most 10000 of them are kept
+SET default_transaction_read_only = on;
+\set ECHO none
+\o /dev/null
+SELECT 'SELECT set_user(''bob'')', 'SELECT reset_user()' FROM generate_series(1, 5001) \gexec
+\o
+\set ECHO all
+SET default_transaction_read_only = off;
+SELECT count(*) FROM set_user_audit_log WHERE target_role = 'bob';
+SELECT count(*) FROM set_user_audit_log WHERE target_role = 'bob';
+ALTER SYSTEM RESET set_user.audit_table;
+SELECT pg_reload_conf();
+
+-- set_user.role_profiles settings come with the transition and go with reset_user()
+ALTER SYSTEM SET set_user.role_profiles = 'bob'; -- should fail
+ALTER SYSTEM SET set_user.role_profiles = 'bob: work_mem=8MB, lock_timeout=5s; joe: work_mem=bogus';
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);
+SELECT set_user('bob');
+SHOW work_mem;
+SHOW lock_timeout;
+SELECT reset_user();
+SHOW work_mem;
+SHOW lock_timeout;
+-- an invalid setting in a profile makes the whole transition fail
+SELECT set_user('joe'); -- should fail
+SELECT SESSION_USER, CURRENT_USER;
+SHOW set_user.active;
+SHOW work_mem;
+ALTER SYSTEM RESET set_user.role_profiles;
+SELECT pg_reload_conf();
+
+-- functions listed in set_user.blocked_internal_functions are blocked by
+-- prosrc, so internal functions aliasing them are blocked as well
+ALTER SYSTEM SET set_user.blocked_internal_functions = 'pg_reload_conf';
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);
+CREATE FUNCTION reload_alias() RETURNS bool AS 'pg_reload_conf' LANGUAGE internal;
+SET SESSION AUTHORIZATION dba;
+SELECT set_user_u('postgres');
+SELECT pg_reload_conf(); -- should fail
+SELECT reload_alias(); -- should fail
+SELECT reset_user();
+RESET SESSION AUTHORIZATION;
+SELECT pg_reload_conf();
+SELECT reload_alias();
+ALTER SYSTEM RESET set_user.blocked_internal_functions;
+SELECT pg_reload_conf();
+DROP FUNCTION reload_alias();
+
+-- functions created in bulk while transitioned, more of them than pg_proc has
+-- pages, are checked in one more pass over pg_proc at commit
+SET SESSION AUTHORIZATION dba;
+SELECT set_user_u('postgres');
+SELECT lower('OK');
+DO $$
+BEGIN
+  FOR i IN 1..1000 LOOP
+    EXECUTE format('CREATE FUNCTION bulk_%s() RETURNS int LANGUAGE sql AS %L', i, 'SELECT ' || i);
+  END LOOP;
+  CREATE FUNCTION bulk_backdoor(text, text, boolean) RETURNS text AS 'set_config_by_name' LANGUAGE internal;
+END
+$$;
+SELECT bulk_1000();
+SELECT bulk_backdoor('work_mem', '8MB', false); -- should fail
+SELECT reset_user();
+RESET SESSION AUTHORIZATION;
+DO $$
+BEGIN
+  FOR i IN 1..1000 LOOP
+    EXECUTE format('DROP FUNCTION bulk_%s()', i);
+  END LOOP;
+END
+$$;
+DROP FUNCTION bulk_backdoor(text, text, boolean);
+
 -- this is an example of how we might audit existing roles
 SET SESSION AUTHORIZATION dba;
 SELECT set_user_u('postgres');
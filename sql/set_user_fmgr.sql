@@ -0,0 +1,41 @@
+-- Run against a server started with set_user.block_method = fmgr, after
+-- installing test/fmgr_alias; see test/test.sh.
+CREATE EXTENSION set_user;
+-- Ensure the library is loaded.
+LOAD 'set_user';
+SHOW set_user.block_method;
+
+-- Clean up in case a prior regression run failed
+-- First suppress NOTICE messages when users/groups don't exist
+SET client_min_messages TO 'warning';
+DROP USER IF EXISTS fmgr_dba;
+RESET client_min_messages;
+
+CREATE USER fmgr_dba;
+GRANT EXECUTE ON FUNCTION set_user_u(text) TO fmgr_dba;
+
+-- set_config_by_name under other names: one by prosrc, one by address
+CREATE FUNCTION backdoor(text, text, boolean) RETURNS text AS 'set_config_by_name' LANGUAGE internal;
+CREATE FUNCTION c_backdoor(text, text, boolean) RETURNS text AS 'set_user_fmgr_alias', 'set_config_alias' LANGUAGE C;
+
+SET SESSION AUTHORIZATION fmgr_dba;
+SELECT set_user_u('postgres');
+SELECT set_config('work_mem', '8MB', false); -- should fail
+SELECT backdoor('work_mem', '8MB', false); -- should fail
+SELECT c_backdoor('work_mem', '8MB', false); -- should fail
+-- other functions are not affected
+SELECT lower('OK');
+SHOW work_mem;
+SELECT reset_user();
+RESET SESSION AUTHORIZATION;
+
+-- all of them work again once reset
+SELECT set_config('work_mem', '8MB', false);
+SELECT backdoor('work_mem', '16MB', false);
+SELECT c_backdoor('work_mem', '32MB', false);
+RESET work_mem;
+
+DROP FUNCTION backdoor(text, text, boolean);
+DROP FUNCTION c_backdoor(text, text, boolean);
+REVOKE EXECUTE ON FUNCTION set_user_u(text) FROM fmgr_dba;
+DROP USER fmgr_dba;
@@ -0,0 +1,57 @@
+-- Clean up in case a prior regression run failed
+-- First suppress NOTICE messages when the extension or users don't exist
+SET client_min_messages TO 'warning';
+DROP EXTENSION IF EXISTS set_user;
+DROP USER IF EXISTS upd_dba, upd_target;
+RESET client_min_messages;
+-- functions created by set_user 4.1.0 all use the legacy set_user entry point
+CREATE EXTENSION set_user VERSION '4.1.0';
+-- Ensure the library is loaded.
+LOAD 'set_user';
+CREATE USER upd_dba;
+CREATE USER upd_target;
+GRANT EXECUTE ON FUNCTION set_user(text) TO upd_dba;
+GRANT EXECUTE ON FUNCTION set_user(text,text) TO upd_dba;
+GRANT EXECUTE ON FUNCTION set_user_u(text) TO upd_dba;
+
+SELECT p.oid::regprocedure AS function, p.prosrc
+  FROM pg_proc p
+ WHERE p.proname IN ('set_user', 'set_user_u', 'reset_user')
+ ORDER BY p.proname, p.pronargs;
+
+SET SESSION AUTHORIZATION upd_dba;
+SELECT set_user('upd_target');
+SELECT SESSION_USER, CURRENT_USER;
+SELECT reset_user();
+SELECT set_user_u('postgres');
+SELECT SESSION_USER, CURRENT_USER;
+SELECT reset_user();
+SELECT set_user('upd_target', 'updtoken');
+SELECT reset_user('updtoken');
+SELECT SESSION_USER, CURRENT_USER;
+RESET SESSION AUTHORIZATION;
+
+-- updating gives each of them an entry point of its own
+ALTER EXTENSION set_user UPDATE;
+SELECT extversion FROM pg_extension WHERE extname = 'set_user';
+SELECT p.oid::regprocedure AS function, p.prosrc
+  FROM pg_proc p
+ WHERE p.proname IN ('set_user', 'set_user_u', 'reset_user')
+ ORDER BY p.proname, p.pronargs;
+
+SET SESSION AUTHORIZATION upd_dba;
+SELECT set_user('upd_target');
+SELECT SESSION_USER, CURRENT_USER;
+SELECT reset_user();
+SELECT set_user_u('postgres');
+SELECT SESSION_USER, CURRENT_USER;
+SELECT reset_user();
+SELECT set_user('upd_target', 'updtoken');
+SELECT reset_user('updtoken');
+SELECT SESSION_USER, CURRENT_USER;
+RESET SESSION AUTHORIZATION;
+
+REVOKE EXECUTE ON FUNCTION set_user(text) FROM upd_dba;
+REVOKE EXECUTE ON FUNCTION set_user(text,text) FROM upd_dba;
+REVOKE EXECUTE ON FUNCTION set_user_u(text) FROM upd_dba;
+DROP USER upd_dba, upd_target;
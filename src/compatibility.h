@@ -16,6 +16,46 @@
 #define NO_ASSERT_AUTH_UID_ONCE !USE_ASSERT_CHECKING
 #endif
 
+/*
+ * PostgreSQL version 18+
+ *
+ * PortalRun() no longer takes a run_once parameter
+ */
+#if PG_VERSION_NUM >= 180000
+#define _PortalRun(portal,count,isTopLevel,dest,altdest,qc) \
+	PortalRun(portal,count,isTopLevel,dest,altdest,qc)
+#else
+#define _PortalRun(portal,count,isTopLevel,dest,altdest,qc) \
+	PortalRun(portal,count,isTopLevel,true,dest,altdest,qc)
+#endif /* 18+ */
+
+/*
+ * PostgreSQL version 18+
+ *
+ * ExecutorRun() no longer takes an execute_once parameter
+ */
+#if PG_VERSION_NUM >= 180000
+#define _EXECUTORRUN_HOOK \
+	static void set_user_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, \
+									 uint64 count)
+
+#define _prev_ExecutorRun \
+	prev_ExecutorRun(queryDesc, direction, count)
+
+#define _standard_ExecutorRun \
+	standard_ExecutorRun(queryDesc, direction, count)
+#else
+#define _EXECUTORRUN_HOOK \
+	static void set_user_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, \
+									 uint64 count, bool execute_once)
+
+#define _prev_ExecutorRun \
+	prev_ExecutorRun(queryDesc, direction, count, execute_once)
+
+#define _standard_ExecutorRun \
+	standard_ExecutorRun(queryDesc, direction, count, execute_once)
+#endif /* 18+ */
+
 /*
  * PostgreSQL version 17+
  *
@@ -30,6 +70,71 @@
 
 #endif /* 17+ */
 
+/*
+ * PostgreSQL version 16+
+ *
+ * Object privileges are checked with object_aclcheck()
+ */
+#if PG_VERSION_NUM >= 160000
+#define _pg_proc_aclcheck(proc,role,mode) \
+	object_aclcheck(ProcedureRelationId,proc,role,mode)
+#else
+#define _pg_proc_aclcheck(proc,role,mode) \
+	pg_proc_aclcheck(proc,role,mode)
+#endif /* 16+ */
+
+/*
+ * PostgreSQL version 16
+ *
+ * get_extension_schema() was static to extension.c
+ */
+#if PG_VERSION_NUM < 160000
+static inline Oid
+get_extension_schema(Oid ext_oid)
+{
+	Oid			result = InvalidOid;
+	Relation	rel;
+	SysScanDesc	scandesc;
+	HeapTuple	tuple;
+	ScanKeyData	entry[1];
+
+	rel = table_open(ExtensionRelationId, AccessShareLock);
+	ScanKeyInit(&entry[0], Anum_pg_extension_oid,
+				BTEqualStrategyNumber, F_OIDEQ,
+				ObjectIdGetDatum(ext_oid));
+	scandesc = systable_beginscan(rel, ExtensionOidIndexId, true,
+								  NULL, 1, entry);
+	tuple = systable_getnext(scandesc);
+	if (HeapTupleIsValid(tuple))
+		result = ((Form_pg_extension) GETSTRUCT(tuple))->extnamespace;
+	systable_endscan(scandesc);
+	table_close(rel, AccessShareLock);
+
+	return result;
+}
+#endif
+
+/*
+ * PostgreSQL version 16
+ *
+ * GUC check hooks must allocate their extra data with guc_malloc(); before,
+ * it was plain malloc()
+ */
+#if PG_VERSION_NUM < 160000
+#define guc_malloc(elevel,size) malloc(size)
+#define guc_free(ptr) free(ptr)
+#endif
+
+/*
+ * PostgreSQL version 15+
+ *
+ * pg_analyze_and_rewrite() was renamed
+ */
+#if PG_VERSION_NUM < 150000
+#define pg_analyze_and_rewrite_fixedparams(parsetree,query,types,ntypes,env) \
+	pg_analyze_and_rewrite(parsetree,query,types,ntypes,env)
+#endif /* 15+ */
+
 /*
  * PostgreSQL version 14+
  *
@@ -81,11 +186,22 @@
 
 #endif /* 13+ */
 
+/*
+ * PostgreSQL version 13
+ *
+ * hash_create() uses string keys unless told otherwise, there is no
+ * HASH_STRINGS flag
+ */
+#if PG_VERSION_NUM < 140000
+#define HASH_STRINGS 0
+#endif
+
 #if !defined(PG_VERSION_NUM) || PG_VERSION_NUM < 130000
 #error "This extension only builds with PostgreSQL 13 or later"
 #endif
 
-/* Use our version-specific static declaration here */
+/* Use our version-specific static declarations here */
 _PU_HOOK;
+_EXECUTORRUN_HOOK;
 
 #endif	/* SET_USER_COMPAT_H */
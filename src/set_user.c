@@ -32,23 +32,54 @@
 #include "access/genam.h"
 #include "access/htup_details.h"
 #include "access/table.h"
+#include "access/xlog.h"
 #include "access/xact.h"
 #include "catalog/indexing.h"
 #include "catalog/objectaccess.h"
 #include "catalog/objectaddress.h"
 #include "catalog/pg_authid.h"
+#include "catalog/pg_extension.h"
+#include "catalog/pg_language.h"
 #include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "commands/dbcommands.h"
+#include "commands/extension.h"
+#include "executor/executor.h"
+#include "common/hashfn.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "libpq/auth.h"
 #include "miscadmin.h"
+#include "parser/analyze.h"
 #include "parser/parse_func.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/bufmgr.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "tcop/pquery.h"
+#include "tcop/tcopprot.h"
 #include "tcop/utility.h"
 #include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/catcache.h"
 #include "utils/fmgroids.h"
+#include "utils/fmgrtab.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/portal.h"
 #include "utils/snapmgr.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
 #include "utils/rel.h"
 #include "utils/varlena.h"
 
@@ -61,8 +92,143 @@ PG_MODULE_MAGIC;
 #define ALLOWLIST_WILDCARD	"*"
 #define SUPERUSER_AUDIT_TAG	"AUDIT"
 
+/* number of rate limiting buckets each for callers and for targets */
+#define SET_USER_RATE_SLOTS	1024
+
+/*
+ * Longest emission interval and burst tolerance, in microseconds, so that a
+ * tiny rate or huge burst cannot overflow the arithmetic; a century is
+ * indistinguishable from forever here.
+ */
+#define SET_USER_RATE_MAX_USECS	(INT64CONST(36525) * USECS_PER_DAY)
+
+/* length of generated reset tokens and lease handles, in hex digits */
+#define SET_USER_TOKEN_LEN	32
+
+/* set_user() called more often than set_user.rate_limit_* allow */
+#define ERRCODE_SET_USER_RATE_LIMITED	MAKE_SQLSTATE('5','3','U','0','1')
+
 static ProcessUtility_hook_type prev_hook = NULL;
 static object_access_hook_type next_object_access_hook;
+static ClientAuthentication_hook_type next_client_auth_hook = NULL;
+static needs_fmgr_hook_type next_needs_fmgr_hook = NULL;
+static fmgr_hook_type next_fmgr_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ExecutorRun_hook_type prev_ExecutorRun = NULL;
+static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+/*
+ * set_user shared state
+ *
+ * Rate limiting uses one token bucket per slot, stored as the theoretical
+ * arrival time of the next allowed call (see set_user_rate_check()). Roles
+ * are hashed to slots, so unrelated roles may occasionally share a bucket.
+ *
+ * Escalation leases (see set_user_create_lease()) live in a fixed array
+ * under set_user_lease_lock.
+ */
+typedef struct
+{
+	char		handle[SET_USER_TOKEN_LEN + 1];	/* empty if the slot is unused */
+	Oid			caller;
+	Oid			target;
+	bool		is_superuser;
+	TimestampTz	expires;
+	uint64		escalation_id;
+	int			creator_pid;	/* until its transaction commits, else 0 */
+} SetUserLease;
+
+/* number of transitions which can wait for the deferred hook worker */
+#define SET_USER_HOOK_QUEUE_SIZE	1024
+
+/* a committed transition, as handed to the deferred hook worker */
+typedef struct
+{
+	bool		is_reset;
+	Oid			session_userid;		/* session user of the backend */
+	char		username[NAMEDATALEN];
+} SetUserHookEvent;
+
+typedef struct
+{
+	pg_atomic_uint64	caller_tat[SET_USER_RATE_SLOTS];
+	pg_atomic_uint64	target_tat[SET_USER_RATE_SLOTS];
+	pg_atomic_uint64	caller_rejected;
+	pg_atomic_uint64	target_rejected;
+	pid_t				job_launcher_pid;
+	pg_atomic_uint64	next_escalation_id;
+	pid_t				hook_worker_pid;
+	uint64				hook_head;		/* next event to be added */
+	uint64				hook_tail;		/* next event to be delivered */
+	SetUserHookEvent	hook_events[SET_USER_HOOK_QUEUE_SIZE];
+	SetUserLease		leases[FLEXIBLE_ARRAY_MEMBER];	/* set_user.max_leases */
+} SetUserSharedState;
+
+static SetUserSharedState *set_user_shared = NULL;
+
+/* protects set_user_shared->leases */
+static LWLock *set_user_lease_lock = NULL;
+
+/* protects the deferred hook queue in set_user_shared */
+static LWLock *set_user_hook_lock = NULL;
+
+/* length of the error message a job worker can report */
+#define SET_USER_JOB_ERRLEN	1024
+
+/* a job, as handed from the launcher to its worker */
+typedef struct
+{
+	int64	jobid;
+	Oid		dboid;
+	Oid		roleid;
+	Oid		submitter;
+	bool	succeeded;
+	char	error[SET_USER_JOB_ERRLEN];
+	char	command[FLEXIBLE_ARRAY_MEMBER];
+} SetUserJob;
+
+/* a job being run, as tracked by the launcher */
+typedef struct
+{
+	int64	jobid;
+	dsm_segment *seg;
+	BackgroundWorkerHandle *handle;
+} SetUserJobSlot;
+
+/* maximum number of audit events written by one INSERT */
+#define SET_USER_AUDIT_BATCH	1000
+
+/* most audit events kept for a later transaction, when they cannot be written */
+#define SET_USER_AUDIT_MAX_CARRIED	10000
+
+/* an event waiting to be written to set_user_audit_log */
+typedef struct
+{
+	TimestampTz	event_time;
+	const char *event_type;
+	char	   *session_role;
+	char	   *acting_role;
+	char	   *target_role;		/* NULL for DDL */
+	uint64		escalation_id;		/* 0 if none */
+	char	   *command_tag;		/* NULL for transitions */
+	char	   *statement;			/* NULL for transitions */
+} SetUserAuditEvent;
+
+static MemoryContext audit_context = NULL;
+static List *audit_events = NIL;
+
+/* leading events of audit_events left over by already committed transactions */
+static int audit_carried = 0;
+
+/* set_user_submit_job() was called; wake the launcher at commit */
+static bool job_wakeup_pending = false;
+
+/* set_user_create_lease() was called; publish or drop the leases at the end */
+static bool lease_pending = false;
 
 /* transaction handler */
 static void set_user_xact_handler (XactEvent event, void *arg);
@@ -76,8 +242,18 @@ typedef struct
 	char *log_statement;
 	const char *log_prefix;
 	char *reset_token;
+	uint64 escalation_id;	/* lease the transition was made under, or 0 */
+	List *profile;			/* settings to apply with the transition */
+	List *profile_restore;	/* settings to apply when transitioning back */
 } SetUserXactState;
 
+/* one name=value entry of set_user.role_profiles */
+typedef struct
+{
+	char *name;
+	char *value;
+} SetUserProfileSetting;
+
 static SetUserXactState	*curr_state;
 static SetUserXactState *pending_state;
 static SetUserXactState	*prev_state;
@@ -85,6 +261,48 @@ static void set_user_free_state(SetUserXactState **state);
 
 static bool is_reset = false;
 
+/* depth of executor and utility calls, 0 between top-level statements */
+static int exec_nested_level = 0;
+
+/* the transaction was started by BEGIN or START TRANSACTION, or chained */
+static bool xact_block_explicit = false;
+
+/* COMMIT or ROLLBACK AND CHAIN: the next transaction is an explicit block too */
+static bool xact_chain_pending = false;
+
+/*
+ * set_user state before the first transition the current transaction made,
+ * restored if it aborts
+ */
+typedef struct
+{
+	bool		saved;
+	SetUserXactState *curr;
+	SetUserXactState *prev;
+	Oid			roleid;
+	bool		is_superuser;
+	/* role names for the log line, as catalogs cannot be read at abort */
+	char		rolename[NAMEDATALEN];
+	char		applied[NAMEDATALEN];
+	bool		applied_superuser;
+} SetUserXactStart;
+
+static SetUserXactStart xact_start;
+
+/*
+ * A transition was rolled back; the in-process hooks are told at the start of
+ * the next statement, as they cannot run while the transaction aborts
+ */
+static bool rollback_hook_pending = false;
+static bool rollback_hook_is_reset = false;
+static char rollback_hook_username[NAMEDATALEN];
+
+static void set_user_apply_transition(void);
+static void set_user_report_state(void);
+static void set_user_statement_end(void);
+static void set_user_ExecutorFinish(QueryDesc *queryDesc);
+static void set_user_ExecutorEnd(QueryDesc *queryDesc);
+
 static const char		   *su = "Superuser ";
 static const char		   *nsu = "";
 
@@ -93,95 +311,391 @@ static bool Block_CP = false;
 static bool Block_LS = false;
 static char *SU_Allowlist = NULL;
 static char *NOSU_TargetAllowlist = NULL;
+
+/* one role of an allowlist, "+role" standing for the members of role */
+typedef struct
+{
+	bool	is_group;
+	char	name[NAMEDATALEN];
+} AllowlistEntry;
+
+/* an allowlist as parsed by its GUC check hook */
+typedef struct
+{
+	bool	wildcard;
+	int		nentries;
+	AllowlistEntry entries[FLEXIBLE_ARRAY_MEMBER];
+} CompiledAllowlist;
+
+static CompiledAllowlist *SU_AllowlistCompiled = NULL;
+static CompiledAllowlist *NOSU_TargetAllowlistCompiled = NULL;
+
+/* in force instead of an allowlist whose configured value was rejected */
+static CompiledAllowlist deny_allowlist;
 static char *SU_AuditTag = NULL;
 static bool exit_on_error = true;
+static char *Login_RoleMap = NULL;
+
+/* set_user.login_role_map, as parsed by its check hook */
+typedef struct
+{
+	char	login[NAMEDATALEN];
+	char	target[NAMEDATALEN];
+} LoginRoleMapEntry;
+
+typedef struct
+{
+	int		nentries;
+	LoginRoleMapEntry entries[FLEXIBLE_ARRAY_MEMBER];
+} CompiledLoginRoleMap;
+
+static CompiledLoginRoleMap *Login_RoleMapCompiled = NULL;
+static char *Role_Profiles = NULL;
+
+/*
+ * set_user.role_profiles, as parsed by its check hook. The strings follow the
+ * entries in the same allocation.
+ */
+typedef struct
+{
+	const char *role;
+	const char *name;
+	const char *value;
+} RoleProfileEntry;
+
+typedef struct
+{
+	int		nentries;
+	RoleProfileEntry entries[FLEXIBLE_ARRAY_MEMBER];
+} CompiledRoleProfiles;
+
+static CompiledRoleProfiles *Role_ProfilesCompiled = NULL;
+
+/* read-only settings reporting the set_user state to clients */
+static bool Report_Active = false;
+static char *Report_TargetRole = NULL;
+static bool Report_Elevated = false;
+static double Rate_Limit_Caller = 0;
+static double Rate_Limit_Target = 0;
+static int Rate_Limit_Burst = 10;
+static int Job_MaxWorkers = 0;
+static char *Job_Database = NULL;
+static char *Deferred_HookDatabase = NULL;
+static int Job_Naptime = 10000;
+static int Max_Leases = 16;
+static bool Audit_Table = false;
+static char *Blocked_InternalFunctions = NULL;
 static const char *set_config_proc_name = "set_config_by_name";
-static List *set_config_oid_cache = NIL;
+
+/* `prosrc` names of the internal functions blocked while transitioned */
+typedef struct
+{
+	char	prosrc[NAMEDATALEN];
+} BlockedNameEntry;
+
+/* functions whose `prosrc` is one of the blocked names */
+typedef struct
+{
+	Oid		procoid;
+	bool	is_set_config;
+} BlockedProcEntry;
+
+static HTAB *blocked_names = NULL;
+static bool blocked_names_valid = false;
+static HTAB *blocked_oids = NULL;
+static bool blocked_oids_valid = false;
+
+/*
+ * Functions created or altered since the Oid cache was last brought up to
+ * date. They are looked at when called, or else all together at commit.
+ */
+typedef struct
+{
+	Oid		procoid;
+	bool	resolved;		/* looked at already, by set_user_block_proc() */
+} DirtyProcEntry;
+
+static HTAB *dirty_procs = NULL;
+
+/*
+ * Pages read by a lookup of a function by Oid which misses the cache: the
+ * index descent and the heap page. Once the dirty functions would cost more
+ * than the pages of pg_proc, it is scanned once instead.
+ */
+#define SET_USER_PROC_LOOKUP_PAGES	4
+
+/* builtin function addresses blocked by the fmgr block method */
+typedef struct
+{
+	PGFunction	addr;
+	bool		is_set_config;
+} BlockedAddrEntry;
+
+static HTAB *blocked_addrs = NULL;
+
+/* how blocked functions are recognized */
+typedef enum
+{
+	SET_USER_BLOCK_CATALOG,		/* scan pg_proc for `prosrc` matches */
+	SET_USER_BLOCK_FMGR			/* match resolved function addresses */
+} SetUserBlockMethod;
+
+static const struct config_enum_entry block_method_options[] = {
+	{"catalog", SET_USER_BLOCK_CATALOG, false},
+	{"fmgr", SET_USER_BLOCK_FMGR, false},
+	{NULL, 0, false}
+};
+
+static int Block_Method = SET_USER_BLOCK_CATALOG;
+
+/* revocable set_session_auth() state */
+static char *session_auth_username = NULL;
+static char *session_auth_token = NULL;
+
+/* transitions awaiting the deferred hooks, handed over once committed */
+static List *deferred_events = NIL;
 
 static void PostSetUserHook(bool is_reset, const char *newuser);
+static void set_user_notify_rollback(void);
+static void QueueDeferredHookEvent(bool is_reset, const char *username);
+static void PublishDeferredHookEvents(void);
+static void DiscardDeferredHookEvents(void);
+static void set_user_deliver_hook_event(SetUserHookEvent *event);
+PGDLLEXPORT void set_user_hook_worker_main(Datum main_arg);
+static void set_user_discard_all(void);
+static char *trim_whitespace(char *str);
+static void set_user_load_profile(void);
+static void set_user_apply_profile(List *profile);
+static void set_user_client_auth(Port *port, int status);
+static void set_user_shmem_request(void);
+static void set_user_shmem_startup(void);
+static void set_user_rate_limit(Oid callerId, Oid targetId);
+static void set_user_prepare_state(Oid callerId);
+static void set_user_audit_record(const char *event_type, const char *target_role,
+								  uint64 escalation_id, const char *command_tag,
+								  const char *statement);
+static void set_user_audit_flush(void);
+static void set_user_audit_discard(void);
+static void set_user_audit_keep(int nkeep);
+static void set_user_end_leases(bool commit);
+static void set_user_prepare_reset(void);
+static Size set_user_shmem_size(void);
+static void set_user_random_token(char *token);
+static const char *set_user_missing_execute(Oid nspid, Oid userid, Oid roleid);
+static bool set_user_may_execute(Oid nspid, const char *setfunc, Oid userid);
+
+/* which SQL function a call to set_user_entry() is on behalf of */
+typedef enum
+{
+	SET_USER_ENTRY_SET,			/* set_user(text), set_user(text, text) */
+	SET_USER_ENTRY_SET_U,		/* set_user_u(text) */
+	SET_USER_ENTRY_RESET		/* reset_user(), reset_user(text) */
+} SetUserEntryPoint;
+
+static Datum set_user_entry(FunctionCallInfo fcinfo, SetUserEntryPoint entry);
 
 extern Datum set_user(PG_FUNCTION_ARGS);
+extern Datum set_user_role(PG_FUNCTION_ARGS);
+extern Datum set_user_u(PG_FUNCTION_ARGS);
+extern Datum reset_user(PG_FUNCTION_ARGS);
 void _PG_init(void);
 void _PG_fini(void);
+PGDLLEXPORT void set_user_job_launcher_main(Datum main_arg);
+PGDLLEXPORT void set_user_job_worker_main(Datum main_arg);
 
-/* used to block set_config() */
+/* used to block set_config() and the other blocked internal functions */
 static void set_user_object_access(ObjectAccessType access, Oid classId, Oid objectId, int subId, void *arg);
-static void set_user_block_set_config(Oid functionId);
+static bool check_blocked_internal_functions(char **newval, void **extra, GucSource source);
+static bool check_allowlist(char **newval, void **extra, GucSource source);
+static void assign_superuser_allowlist(const char *newval, void *extra);
+static void assign_nosuperuser_target_allowlist(const char *newval, void *extra);
+static void assign_blocked_internal_functions(const char *newval, void *extra);
+static void set_user_build_blocked_names(void);
+static bool set_user_is_blocked_name(const char *prosrc);
+static void set_user_block_proc(Oid functionId);
+static void set_user_report_blocked(Oid functionId, bool is_set_config);
+static void set_user_reset_blocked_oids(void);
+static void set_user_cache_builtins(void);
+static bool set_user_needs_fmgr_hook(Oid functionId);
+static void set_user_fmgr_hook(FmgrHookEventType event, FmgrInfo *flinfo, Datum *arg);
 static void set_user_check_proc(HeapTuple procTup, Relation rel);
 static void set_user_cache_proc(Oid functionId);
+static void set_user_mark_proc_dirty(Oid functionId);
+static void set_user_resolve_proc(Oid functionId);
+static void set_user_resolve_dirty_procs(void);
+static void set_user_clear_dirty_procs(void);
 
 /*
- * check_user_allowlist
- *
- * Check if user is contained by allowlist
+ * check_allowlist
  *
+ * GUC check hook for the allowlists. The list is parsed here, once, into a
+ * CompiledAllowlist which the assign hook makes current, so that checking a
+ * role against it involves no parsing.
  */
 static bool
-check_user_allowlist(Oid userId, const char *allowlist)
+check_allowlist(char **newval, void **extra, GucSource source)
 {
-	char	   *rawstring = NULL;
+	char	   *rawstring;
 	List	   *elemlist;
 	ListCell   *l;
-	bool		result = false;
+	CompiledAllowlist *allowlist;
+	int			i = 0;
 
-	if (allowlist == NULL || allowlist[0] == '\0')
+	rawstring = pstrdup(*newval);
+	if (!SplitIdentifierString(rawstring, ',', &elemlist))
+	{
+		GUC_check_errdetail("List syntax is invalid.");
+		pfree(rawstring);
+		list_free(elemlist);
 		return false;
+	}
 
-	rawstring = pstrdup(allowlist);
-
-	/* Parse string into list of identifiers */
-	if (!SplitIdentifierString(rawstring, ',', &elemlist))
+	allowlist = (CompiledAllowlist *) guc_malloc(LOG, offsetof(CompiledAllowlist, entries) +
+												 list_length(elemlist) * sizeof(AllowlistEntry));
+	if (allowlist == NULL)
 	{
-		/* syntax error in list */
-		ereport(ERROR,
-				(errcode(ERRCODE_SYNTAX_ERROR),
-				 errmsg("invalid syntax in parameter")));
+		pfree(rawstring);
+		list_free(elemlist);
+		return false;
 	}
 
 	/* Allow all users to escalate if allowlist is a solo wildcard character. */
-	if (list_length(elemlist) == 1)
+	allowlist->wildcard = false;
+	if (list_length(elemlist) == 1 &&
+		pg_strcasecmp((char *) linitial(elemlist), ALLOWLIST_WILDCARD) == 0)
+		allowlist->wildcard = true;
+
+	foreach(l, elemlist)
 	{
-		char	   *first_elem = NULL;
+		char	   *elem = (char *) lfirst(l);
+		AllowlistEntry *entry = &allowlist->entries[i];
 
-		first_elem = (char *) linitial(elemlist);
-		if (pg_strcasecmp(first_elem, ALLOWLIST_WILDCARD) == 0)
-			return true;
+		if (allowlist->wildcard)
+			break;
+
+		/* No explicit usernames intermingled with wildcard. */
+		if (pg_strcasecmp(elem, ALLOWLIST_WILDCARD) == 0)
+		{
+			GUC_check_errdetail("The allowlist cannot contain both role names and the "
+								"wildcard character \"%s\".", ALLOWLIST_WILDCARD);
+			guc_free(allowlist);
+			pfree(rawstring);
+			list_free(elemlist);
+			return false;
+		}
+
+		entry->is_group = (elem[0] == '+');
+		if (entry->is_group)
+			elem++;
+
+		if (elem[0] == '\0')
+		{
+			GUC_check_errdetail("Group role name missing after \"+\".");
+			guc_free(allowlist);
+			pfree(rawstring);
+			list_free(elemlist);
+			return false;
+		}
+
+		strlcpy(entry->name, elem, NAMEDATALEN);
+		i++;
 	}
+	allowlist->nentries = i;
 
-	/*
-	 * Check whole allowlist to see if it contains the current username and no
-	 * wildcard character. Throw an error if the allowlist contains both.
-	 */
-	foreach(l, elemlist)
+	pfree(rawstring);
+	list_free(elemlist);
+
+	*extra = allowlist;
+	return true;
+}
+
+static void
+assign_superuser_allowlist(const char *newval, void *extra)
+{
+	SU_AllowlistCompiled = (CompiledAllowlist *) extra;
+}
+
+static void
+assign_nosuperuser_target_allowlist(const char *newval, void *extra)
+{
+	NOSU_TargetAllowlistCompiled = (CompiledAllowlist *) extra;
+}
+
+/*
+ * define_allowlist
+ *
+ * Define an allowlist setting. If the value configured before the library was
+ * loaded is rejected by check_allowlist, the wildcard boot value would stay in
+ * force and allow every role; allow none instead, until a valid value is set.
+ */
+static void
+define_allowlist(const char *name, const char *short_desc, char **variable,
+				 GucStringAssignHook assign_hook, CompiledAllowlist **compiled)
+{
+	const char *placeholder = GetConfigOption(name, true, false);
+	char	   *configured = placeholder ? pstrdup(placeholder) : NULL;
+
+	DefineCustomStringVariable(name, short_desc, NULL, variable,
+							   ALLOWLIST_WILDCARD, PGC_SIGHUP,
+							   0, check_allowlist, assign_hook, NULL);
+
+	if (configured != NULL && strcmp(configured, *variable) != 0)
 	{
-		char	   *elem = (char *) lfirst(l);
+		*compiled = &deny_allowlist;
+		ereport(WARNING,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid value for parameter \"%s\", no role is allowed until it is corrected",
+						name)));
+	}
+
+	if (configured != NULL)
+		pfree(configured);
+}
+
+/*
+ * check_user_allowlist
+ *
+ * Check if user is contained by allowlist, either by name or as a member of
+ * one of its group roles.
+ *
+ */
+static bool
+check_user_allowlist(Oid userId, const CompiledAllowlist *allowlist)
+{
+	char	   *username = NULL;
+	int			i;
+
+	if (allowlist == NULL)
+		return false;
+
+	if (allowlist->wildcard)
+		return true;
 
-		if (elem[0] == '+')
+	for (i = 0; i < allowlist->nentries; i++)
+	{
+		const AllowlistEntry *entry = &allowlist->entries[i];
+
+		if (entry->is_group)
 		{
-			Oid roleId;
-			roleId = get_role_oid(elem + 1, false);
-			if (!OidIsValid(roleId))
-				result = false;
+			Oid			groupId = get_role_oid(entry->name, true);
 
-			/* Check to see if userId is contained by group role in allowlist */
-			result = has_privs_of_role(userId, roleId);
+			/*
+			 * Check to see if userId is contained by group role in allowlist.
+			 * Nobody is a member of a group which has been dropped.
+			 */
+			if (OidIsValid(groupId) && has_privs_of_role(userId, groupId))
+				return true;
 		}
 		else
 		{
-			if (pg_strcasecmp(elem, GetUserNameFromId(userId, false)) == 0)
-				result = true;
-			else if(pg_strcasecmp(elem, ALLOWLIST_WILDCARD) == 0)
-				/* No explicit usernames intermingled with wildcard. */
-				ereport(ERROR,
-						(errcode(ERRCODE_SYNTAX_ERROR),
-						 errmsg("invalid syntax in parameter"),
-						 errhint("Either remove users from set_user.superuser_allowlist "
-								 "or remove the wildcard character \"%s\". The allowlist "
-								 "cannot contain both.",
-								 ALLOWLIST_WILDCARD)));
+			if (username == NULL)
+				username = GetUserNameFromId(userId, false);
+			if (pg_strcasecmp(entry->name, username) == 0)
+				return true;
 		}
 	}
-	return result;
+
+	return false;
 }
 
 /*
@@ -209,178 +723,438 @@ check_user_allowlist(Oid userId, const char *allowlist)
  }
 
 /*
- * Similar to SET ROLE but with added logging and some additional
- * control over allowed actions
+ * check_role_profiles
  *
+ * Parse set_user.role_profiles when it is set, so that a transition only has
+ * to look up the target role. The parameter has the form
+ * "role:name=value,name=value; role2:name=value", so values cannot contain
+ * commas or semicolons. The values themselves are validated on transition,
+ * as the settings they name may belong to libraries not loaded yet.
  */
-PG_FUNCTION_INFO_V1(set_user);
-Datum
-set_user(PG_FUNCTION_ARGS)
+static bool
+check_role_profiles(char **newval, void **extra, GucSource source)
 {
-	bool				argisnull = PG_ARGISNULL(0);
-	int					nargs = PG_NARGS();
-	HeapTuple			roleTup;
-	MemoryContext		oldcontext = NULL;
-	bool				is_token = false;
-	bool				is_privileged = false;
+	char	   *rawstring;
+	char	   *profile;
+	char	   *nextprofile;
+	List	   *entries = NIL;
+	ListCell   *l;
+	Size		strsize = 0;
+	CompiledRoleProfiles *profiles;
+	char	   *strings;
+	int			i = 0;
 
-	/*
-	 * Disallow `set_user()` inside a transaction block. The
-	 * semantics are too strange, and I cannot think of a
-	 * good use case where it would make sense anyway.
-	 * Perhaps one day we will need to rethink this...
-	 */
-	if (IsTransactionBlock())
-	{
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set_user: \"set_user()\" not allowed within transaction block"),
-				 errhint("Use \"set_user()\" outside transaction block instead.")));
-	}
+	rawstring = pstrdup(*newval);
 
-	/*
-	 * set_user(non_null_arg text)
-	 *
-	 * Might be set_user(username) but might also be set_user(reset_token).
-	 * The former case we need to switch user normally, the latter is a
-	 * reset with token provided. We need to determine which one we have.
-	 */
-	if (nargs == 1 && !argisnull)
+	for (profile = rawstring; profile != NULL; profile = nextprofile)
 	{
-		Oid				funcOid = fcinfo->flinfo->fn_oid;
-		HeapTuple		procTup;
-		Form_pg_proc	procStruct;
-		char		   *funcname;
+		char	   *role;
+		char	   *item;
+		char	   *nextitem;
 
-		/* Lookup the pg_proc tuple by Oid */
-		procTup = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcOid));
-		if (!HeapTupleIsValid(procTup))
-			elog(ERROR, "cache lookup failed for function %u", funcOid);
+		nextprofile = strchr(profile, ';');
+		if (nextprofile != NULL)
+			*nextprofile++ = '\0';
 
-		procStruct = (Form_pg_proc) GETSTRUCT(procTup);
-		if (!procStruct)
+		item = strchr(profile, ':');
+		if (item == NULL)
 		{
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-					 errmsg("set_user: function lookup failed for %u", funcOid)));
-		}
+			/* allow a trailing or doubled separator */
+			if (*trim_whitespace(profile) == '\0')
+				continue;
 
-		funcname = pstrdup(NameStr(procStruct->proname));
-		ReleaseSysCache(procTup);
-
-		if (strcmp(funcname, "reset_user") == 0)
-		{
-			is_reset = true;
-			is_token = true;
+			GUC_check_errdetail("Entry \"%s\" is not of the form \"role:name=value,...\".",
+								trim_whitespace(profile));
+			list_free_deep(entries);
+			pfree(rawstring);
+			return false;
 		}
 
-		if (strcmp(funcname, "set_user_u") == 0)
-			is_privileged = true;
-	}
-	/*
-	 * set_user() or set_user(NULL) ==> always a reset
-	 */
-	else if (nargs == 0 || (nargs == 1 && argisnull))
-		is_reset = true;
-
-	/* Switch to a persistent memory context to store state */
-	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		*item++ = '\0';
+		role = trim_whitespace(profile);
 
-	/* Need to pfree in the case of a reset with no initial set */
-	pending_state = palloc0(sizeof(SetUserXactState));
-	if ((nargs == 1 && !is_reset) || nargs == 2)
-	{
-		/* we are setting a new user */
-		if (prev_state != NULL && prev_state->userid != InvalidOid)
+		for (; item != NULL; item = nextitem)
 		{
-			ereport(ERROR,
-					(errcode(ERRCODE_INTERNAL_ERROR),
-					 errmsg("must reset previous user prior to setting again")));
-		}
+			RoleProfileEntry *entry;
+			char	   *value;
 
-		pending_state->username = text_to_cstring(PG_GETARG_TEXT_PP(0));
+			nextitem = strchr(item, ',');
+			if (nextitem != NULL)
+				*nextitem++ = '\0';
 
-		/* with 2 args, the caller wants to specify a reset token */
-		if (nargs == 2)
-		{
-			/* this should never be NULL but just in case */
-			if (PG_ARGISNULL(1))
+			value = strchr(item, '=');
+			if (value == NULL || *trim_whitespace(item) == '=')
 			{
-				ereport(ERROR,
-						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-						 errmsg("set_user: NULL reset_token not valid")));
+				GUC_check_errdetail("Setting \"%s\" of role \"%s\" is not of the form \"name=value\".",
+									trim_whitespace(item), role);
+				list_free_deep(entries);
+				pfree(rawstring);
+				return false;
 			}
 
-			/*capture the reset token */
-			pending_state->reset_token = text_to_cstring(PG_GETARG_TEXT_PP(1));
+			*value++ = '\0';
+			entry = palloc(sizeof(RoleProfileEntry));
+			entry->role = role;
+			entry->name = trim_whitespace(item);
+			entry->value = trim_whitespace(value);
+			strsize += strlen(entry->role) + strlen(entry->name) + strlen(entry->value) + 3;
+			entries = lappend(entries, entry);
 		}
+	}
 
-		/* Look up the username */
-		roleTup = SearchSysCache1(AUTHNAME, PointerGetDatum(pending_state->username));
-		if (!HeapTupleIsValid(roleTup))
-			elog(ERROR, "role \"%s\" does not exist", pending_state->username);
+	profiles = (CompiledRoleProfiles *) guc_malloc(LOG, offsetof(CompiledRoleProfiles, entries) +
+												   list_length(entries) * sizeof(RoleProfileEntry) +
+												   strsize);
+	if (profiles == NULL)
+	{
+		list_free_deep(entries);
+		pfree(rawstring);
+		return false;
+	}
 
-		pending_state->userid = heap_tuple_get_oid(roleTup, AuthIdRelationId);
-		pending_state->is_superuser = ((Form_pg_authid) GETSTRUCT(roleTup))->rolsuper;
-		ReleaseSysCache(roleTup);
+	strings = (char *) &profiles->entries[list_length(entries)];
+	foreach(l, entries)
+	{
+		RoleProfileEntry *entry = (RoleProfileEntry *) lfirst(l);
 
-		if (pending_state->is_superuser)
-		{
-			if (!is_privileged)
-				/* can only escalate with set_user_u */
-				ereport(ERROR,
-						(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-						 errmsg("switching to superuser not allowed"),
-						 errhint("Use \'set_user_u\' to escalate.")));
-			else if (!check_user_allowlist(GetUserId(), SU_Allowlist))
-				/* check superuser allowlist*/
-				ereport(ERROR,
-						(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-						 errmsg("switching to superuser not allowed"),
-						 errhint("Add current user to set_user.superuser_allowlist.")));
-		}
-		else if(!check_user_allowlist(pending_state->userid, NOSU_TargetAllowlist))
-		{
-			ereport(ERROR,
-					(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-					 errmsg("switching to role is not allowed"),
-					 errhint("Add target role to set_user.nosuperuser_target_allowlist.")));
-		}
+		profiles->entries[i].role = strings;
+		strings += strlcpy(strings, entry->role, strsize) + 1;
+		profiles->entries[i].name = strings;
+		strings += strlcpy(strings, entry->name, strsize) + 1;
+		profiles->entries[i].value = strings;
+		strings += strlcpy(strings, entry->value, strsize) + 1;
+		i++;
+	}
+	profiles->nentries = i;
 
-		/* Keep track of current state */
-		if (curr_state == NULL)
-		{
-			curr_state = palloc0(sizeof(SetUserXactState));
-			curr_state->log_statement = pstrdup(GetConfigOption("log_statement", false, false));
-			curr_state->log_prefix = pstrdup(GetConfigOption("log_line_prefix", true, false));
-			curr_state->reset_token = pending_state->reset_token;
-			curr_state->userid = GetUserId();
-			curr_state->username = GetUserNameFromId(curr_state->userid, false);
-			curr_state->is_superuser = superuser_arg(curr_state->userid);
-		}
+	list_free_deep(entries);
+	pfree(rawstring);
 
-		if (pending_state->is_superuser && Block_LS)
-		{
-			pending_state->log_prefix = NULL;
+	*extra = profiles;
+	return true;
+}
 
-			/*
-			 * Add a custom AUDIT tag to postgresql.conf setting
-			 * 'log_line_prefix' so log statements are tagged for easy
-			 * filtering.
-			 */
-			if (curr_state->log_prefix)
-				pending_state->log_prefix = psprintf("%s%s: ", curr_state->log_prefix, SU_AuditTag);
-			else
-				pending_state->log_prefix = pstrdup(SU_AuditTag);
+static void
+assign_role_profiles(const char *newval, void *extra)
+{
+	Role_ProfilesCompiled = (CompiledRoleProfiles *) extra;
+}
 
-			/*
-			 * Force logging of everything if block_log_statement is true
-			 * and we are escalating to superuser. If not escalating to superuser the
-			 * caller could always set log_statement to all prior to using set_user,
-			 * and ensure Block_LS is true.
-			 */
-			pending_state->log_statement = pstrdup("all");
+/*
+ * get_role_profile
+ *
+ * Return the settings which set_user.role_profiles lists for the role, as a
+ * List of SetUserProfileSetting.
+ */
+static List *
+get_role_profile(const char *rolename)
+{
+	List	   *settings = NIL;
+	int			i;
+
+	if (Role_ProfilesCompiled == NULL)
+		return NIL;
+
+	for (i = 0; i < Role_ProfilesCompiled->nentries; i++)
+	{
+		const RoleProfileEntry *entry = &Role_ProfilesCompiled->entries[i];
+
+		if (pg_strcasecmp(entry->role, rolename) == 0)
+		{
+			SetUserProfileSetting *setting = palloc(sizeof(SetUserProfileSetting));
+
+			setting->name = pstrdup(entry->name);
+			setting->value = pstrdup(entry->value);
+			settings = lappend(settings, setting);
+		}
+	}
+
+	return settings;
+}
+
+/*
+ * trim_whitespace
+ *
+ * Strip leading and trailing whitespace from str in place.
+ */
+static char *
+trim_whitespace(char *str)
+{
+	char	   *end;
+
+	while (isspace((unsigned char) *str))
+		str++;
+
+	end = str + strlen(str);
+	while (end > str && isspace((unsigned char) end[-1]))
+		end--;
+	*end = '\0';
+
+	return str;
+}
+
+/*
+ * set_user_load_profile
+ *
+ * Look up the settings profile of the role named by pending_state->username,
+ * and remember the current value of each setting so that it can be restored
+ * on reset. Each value is validated here, so that applying the profile in the
+ * transaction handler cannot fail. Must be called in a persistent memory
+ * context.
+ */
+static void
+set_user_load_profile(void)
+{
+	ListCell   *l;
+
+	pending_state->profile = get_role_profile(pending_state->username);
+	pending_state->profile_restore = NIL;
+
+	foreach(l, pending_state->profile)
+	{
+		SetUserProfileSetting *setting = (SetUserProfileSetting *) lfirst(l);
+		SetUserProfileSetting *orig;
+
+		(void) set_config_option(setting->name, setting->value,
+								 PGC_SUSET, PGC_S_SESSION,
+								 GUC_ACTION_SET, false, ERROR, false);
+
+		orig = palloc(sizeof(SetUserProfileSetting));
+		orig->name = setting->name;
+		orig->value = (char *) GetConfigOption(setting->name, false, false);
+
+		/* a NULL value restores the default */
+		if (orig->value != NULL)
+			orig->value = pstrdup(orig->value);
+		pending_state->profile_restore = lappend(pending_state->profile_restore, orig);
+	}
+}
+
+/*
+ * set_user_apply_profile
+ *
+ * Apply a list of settings loaded by set_user_load_profile().
+ */
+static void
+set_user_apply_profile(List *profile)
+{
+	ListCell   *l;
+
+	foreach(l, profile)
+	{
+		SetUserProfileSetting *setting = (SetUserProfileSetting *) lfirst(l);
+
+		SetConfigOption(setting->name, setting->value, PGC_SUSET, PGC_S_SESSION);
+	}
+}
+
+/*
+ * set_user_check_allowlists
+ *
+ * Enforce the allowlists for a transition to targetId by callerId.
+ */
+static void
+set_user_check_allowlists(Oid callerId, Oid targetId, bool target_is_superuser,
+						  bool is_privileged)
+{
+	if (target_is_superuser)
+	{
+		if (!is_privileged)
+			/* can only escalate with set_user_u */
+			ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+					 errmsg("switching to superuser not allowed"),
+					 errhint("Use \'set_user_u\' to escalate.")));
+		else if (!check_user_allowlist(callerId, SU_AllowlistCompiled))
+			/* check superuser allowlist*/
+			ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+					 errmsg("switching to superuser not allowed"),
+					 errhint("Add current user to set_user.superuser_allowlist.")));
+	}
+	else if(!check_user_allowlist(targetId, NOSU_TargetAllowlistCompiled))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("switching to role is not allowed"),
+				 errhint("Add target role to set_user.nosuperuser_target_allowlist.")));
+	}
+}
+
+/*
+ * set_user_prepare_transition
+ *
+ * Look up the role named by pending_state->username, enforce the allowlists
+ * for a transition to it by callerId, and fill in the rest of pending_state
+ * (and curr_state, if this is the first transition) for the transaction
+ * handler. Must be called in a persistent memory context.
+ */
+static void
+set_user_prepare_transition(Oid callerId, bool is_privileged)
+{
+	HeapTuple			roleTup;
+
+	/* Look up the username */
+	roleTup = SearchSysCache1(AUTHNAME, PointerGetDatum(pending_state->username));
+	if (!HeapTupleIsValid(roleTup))
+		elog(ERROR, "role \"%s\" does not exist", pending_state->username);
+
+	pending_state->userid = heap_tuple_get_oid(roleTup, AuthIdRelationId);
+	pending_state->is_superuser = ((Form_pg_authid) GETSTRUCT(roleTup))->rolsuper;
+	ReleaseSysCache(roleTup);
+
+	set_user_check_allowlists(callerId, pending_state->userid,
+							  pending_state->is_superuser, is_privileged);
+	set_user_prepare_state(callerId);
+}
+
+/*
+ * set_user_prepare_state
+ *
+ * Fill in the rest of pending_state for a transition by callerId to the role
+ * already in pending_state, once it has been checked, and curr_state if this
+ * is the first transition. Must be called in a persistent memory context.
+ */
+static void
+set_user_prepare_state(Oid callerId)
+{
+	set_user_load_profile();
+
+	/* Keep track of current state */
+	if (curr_state == NULL)
+	{
+		curr_state = palloc0(sizeof(SetUserXactState));
+		curr_state->log_statement = pstrdup(GetConfigOption("log_statement", false, false));
+		curr_state->log_prefix = pstrdup(GetConfigOption("log_line_prefix", true, false));
+		curr_state->reset_token = pending_state->reset_token;
+		curr_state->userid = callerId;
+		curr_state->username = GetUserNameFromId(curr_state->userid, false);
+		curr_state->is_superuser = superuser_arg(curr_state->userid);
+	}
+
+	if (pending_state->is_superuser && Block_LS)
+	{
+		pending_state->log_prefix = NULL;
+
+		/*
+		 * Add a custom AUDIT tag to postgresql.conf setting
+		 * 'log_line_prefix' so log statements are tagged for easy
+		 * filtering.
+		 */
+		if (curr_state->log_prefix)
+			pending_state->log_prefix = psprintf("%s%s: ", curr_state->log_prefix, SU_AuditTag);
+		else
+			pending_state->log_prefix = pstrdup(SU_AuditTag);
+
+		/*
+		 * Force logging of everything if block_log_statement is true
+		 * and we are escalating to superuser. If not escalating to superuser the
+		 * caller could always set log_statement to all prior to using set_user,
+		 * and ensure Block_LS is true.
+		 */
+		pending_state->log_statement = pstrdup("all");
+	}
+}
+
+/*
+ * set_user_prepare_reset
+ *
+ * Fill in pending_state for a transition back to the role prev_state
+ * recorded. Must be called in a persistent memory context.
+ */
+static void
+set_user_prepare_reset(void)
+{
+	/* store old state as pending */
+	pending_state->userid = prev_state->userid;
+	pending_state->username = GetUserNameFromId(prev_state->userid, false);
+	pending_state->log_statement = prev_state->log_statement;
+	pending_state->log_prefix = prev_state->log_prefix;
+	pending_state->is_superuser = superuser_arg(prev_state->userid);
+	pending_state->profile = curr_state->profile_restore;
+}
+
+/*
+ * Similar to SET ROLE but with added logging and some additional
+ * control over allowed actions
+ *
+ */
+static Datum
+set_user_entry(FunctionCallInfo fcinfo, SetUserEntryPoint entry)
+{
+	int					nargs = PG_NARGS();
+	bool				argisnull = (nargs > 0 && PG_ARGISNULL(0));
+	MemoryContext		oldcontext = NULL;
+	bool				is_token = false;
+	bool				is_privileged = (entry == SET_USER_ENTRY_SET_U);
+
+	/*
+	 * Disallow `set_user()` inside an explicit transaction block. The
+	 * semantics are too strange, and I cannot think of a
+	 * good use case where it would make sense anyway.
+	 * Perhaps one day we will need to rethink this...
+	 *
+	 * Implicit blocks (several statements sent as one query string) and
+	 * pipelines are fine: the transition is applied at the end of the
+	 * statement, and undone if the transaction aborts.
+	 */
+	if ((xact_block_explicit && IsTransactionBlock()) || IsSubTransaction())
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set_user: \"set_user()\" not allowed within transaction block"),
+				 errhint("Use \"set_user()\" outside transaction block instead.")));
+	}
+
+	/*
+	 * reset_user(non_null_arg text) is a reset with token provided.
+	 */
+	if (entry == SET_USER_ENTRY_RESET)
+	{
+		is_reset = true;
+		is_token = (nargs == 1 && !argisnull);
+	}
+	/*
+	 * set_user() or set_user(NULL) ==> always a reset
+	 */
+	else if (nargs == 0 || (nargs == 1 && argisnull))
+		is_reset = true;
+
+	/* Switch to a persistent memory context to store state */
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	/* Need to pfree in the case of a reset with no initial set */
+	pending_state = palloc0(sizeof(SetUserXactState));
+	if ((nargs == 1 && !is_reset) || nargs == 2)
+	{
+		/* we are setting a new user */
+		if (prev_state != NULL && prev_state->userid != InvalidOid)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("must reset previous user prior to setting again")));
+		}
+
+		pending_state->username = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+		/* with 2 args, the caller wants to specify a reset token */
+		if (nargs == 2)
+		{
+			/* this should never be NULL but just in case */
+			if (PG_ARGISNULL(1))
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("set_user: NULL reset_token not valid")));
+			}
+
+			/*capture the reset token */
+			pending_state->reset_token = text_to_cstring(PG_GETARG_TEXT_PP(1));
 		}
+
+		/* fail fast, before any state is built */
+		set_user_rate_limit(GetUserId(), get_role_oid(pending_state->username, true));
+		set_user_prepare_transition(GetUserId(), is_privileged);
 	}
 	else if (is_reset)
 	{
@@ -414,255 +1188,2678 @@ set_user(PG_FUNCTION_ARGS)
 						errmsg("incorrect reset token provided")));
 			}
 		}
-
-		/* store old state as pending */
-		pending_state->userid = prev_state->userid;
-		pending_state->username = GetUserNameFromId(prev_state->userid, false);
-		pending_state->log_statement = prev_state->log_statement;
-		pending_state->log_prefix = prev_state->log_prefix;
-		pending_state->is_superuser = superuser_arg(prev_state->userid);
+
+		set_user_prepare_reset();
+	}
+	else
+		/* should not happen */
+		elog(ERROR, "unexpected argument combination");
+
+	MemoryContextSwitchTo(oldcontext);
+	PG_RETURN_TEXT_P(cstring_to_text("OK"));
+}
+
+/*
+ * set_user(text), set_user(text, text)
+ */
+PG_FUNCTION_INFO_V1(set_user_role);
+Datum
+set_user_role(PG_FUNCTION_ARGS)
+{
+	return set_user_entry(fcinfo, SET_USER_ENTRY_SET);
+}
+
+/*
+ * set_user_u(text)
+ */
+PG_FUNCTION_INFO_V1(set_user_u);
+Datum
+set_user_u(PG_FUNCTION_ARGS)
+{
+	return set_user_entry(fcinfo, SET_USER_ENTRY_SET_U);
+}
+
+/*
+ * reset_user(), reset_user(text)
+ */
+PG_FUNCTION_INFO_V1(reset_user);
+Datum
+reset_user(PG_FUNCTION_ARGS)
+{
+	return set_user_entry(fcinfo, SET_USER_ENTRY_RESET);
+}
+
+/*
+ * The C function behind all of set_user(), set_user_u() and reset_user() up
+ * to 4.1.0, still used by installations which have not run ALTER EXTENSION
+ * UPDATE. It has to look up which SQL function it was called as, so the
+ * answer is cached in fn_extra to look it up once per call site rather than
+ * once per call.
+ */
+PG_FUNCTION_INFO_V1(set_user);
+Datum
+set_user(PG_FUNCTION_ARGS)
+{
+	SetUserEntryPoint  *entry = (SetUserEntryPoint *) fcinfo->flinfo->fn_extra;
+
+	if (entry == NULL)
+	{
+		entry = MemoryContextAlloc(fcinfo->flinfo->fn_mcxt, sizeof(SetUserEntryPoint));
+		*entry = SET_USER_ENTRY_SET;
+
+		/*
+		 * reset_user() is the only function without arguments, and only
+		 * set_user(text, text) has two. With one we need to determine which
+		 * one we have.
+		 */
+		if (PG_NARGS() == 0)
+			*entry = SET_USER_ENTRY_RESET;
+		else if (PG_NARGS() == 1)
+		{
+			Oid				funcOid = fcinfo->flinfo->fn_oid;
+			HeapTuple		procTup;
+			Form_pg_proc	procStruct;
+
+			/* Lookup the pg_proc tuple by Oid */
+			procTup = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcOid));
+			if (!HeapTupleIsValid(procTup))
+				elog(ERROR, "cache lookup failed for function %u", funcOid);
+
+			procStruct = (Form_pg_proc) GETSTRUCT(procTup);
+			if (strcmp(NameStr(procStruct->proname), "reset_user") == 0)
+				*entry = SET_USER_ENTRY_RESET;
+			else if (strcmp(NameStr(procStruct->proname), "set_user_u") == 0)
+				*entry = SET_USER_ENTRY_SET_U;
+			ReleaseSysCache(procTup);
+		}
+
+		fcinfo->flinfo->fn_extra = entry;
+	}
+
+	return set_user_entry(fcinfo, *entry);
+}
+
+/*
+ * check_login_role_map
+ *
+ * GUC check hook for set_user.login_role_map. Parse the list once, so that a
+ * malformed entry is rejected when the setting is changed, rather than making
+ * every login fail.
+ */
+static bool
+check_login_role_map(char **newval, void **extra, GucSource source)
+{
+	char	   *rawstring;
+	List	   *elemlist;
+	ListCell   *l;
+	CompiledLoginRoleMap *map;
+	int			i = 0;
+
+	rawstring = pstrdup(*newval);
+	if (!SplitIdentifierString(rawstring, ',', &elemlist))
+	{
+		GUC_check_errdetail("List syntax is invalid.");
+		pfree(rawstring);
+		list_free(elemlist);
+		return false;
+	}
+
+	map = (CompiledLoginRoleMap *) guc_malloc(LOG, offsetof(CompiledLoginRoleMap, entries) +
+											  list_length(elemlist) * sizeof(LoginRoleMapEntry));
+	if (map == NULL)
+	{
+		pfree(rawstring);
+		list_free(elemlist);
+		return false;
+	}
+
+	foreach(l, elemlist)
+	{
+		char	   *elem = (char *) lfirst(l);
+		char	   *target = strchr(elem, ':');
+
+		if (target == NULL || target == elem || target[1] == '\0')
+		{
+			GUC_check_errdetail("Entry \"%s\" is not of the form \"login:target\".", elem);
+			guc_free(map);
+			pfree(rawstring);
+			list_free(elemlist);
+			return false;
+		}
+
+		*target++ = '\0';
+		if (strlen(elem) >= NAMEDATALEN || strlen(target) >= NAMEDATALEN)
+		{
+			GUC_check_errdetail("Role name in entry \"%s:%s\" is too long.", elem, target);
+			guc_free(map);
+			pfree(rawstring);
+			list_free(elemlist);
+			return false;
+		}
+
+		strlcpy(map->entries[i].login, elem, NAMEDATALEN);
+		strlcpy(map->entries[i].target, target, NAMEDATALEN);
+		i++;
+	}
+	map->nentries = i;
+
+	pfree(rawstring);
+	list_free(elemlist);
+
+	*extra = map;
+	return true;
+}
+
+static void
+assign_login_role_map(const char *newval, void *extra)
+{
+	Login_RoleMapCompiled = (CompiledLoginRoleMap *) extra;
+}
+
+/*
+ * get_login_role_target
+ *
+ * Return the role which set_user.login_role_map maps the login role to, or
+ * NULL if it is not mapped.
+ */
+static char *
+get_login_role_target(const char *login)
+{
+	int			i;
+
+	if (Login_RoleMapCompiled == NULL)
+		return NULL;
+
+	for (i = 0; i < Login_RoleMapCompiled->nentries; i++)
+	{
+		if (pg_strcasecmp(Login_RoleMapCompiled->entries[i].login, login) == 0)
+			return Login_RoleMapCompiled->entries[i].target;
+	}
+
+	return NULL;
+}
+
+/*
+ * set_user_client_auth
+ *
+ * Apply set_user.login_role_map once the client has authenticated. This runs
+ * inside the backend's startup transaction, before the session user is set
+ * up, so just run the usual checks and queue the transition; the transaction
+ * handler performs and logs it when the startup transaction commits, so the
+ * first query of the session already runs as the target role. Any ERROR here
+ * is FATAL to the connection.
+ */
+static void
+set_user_client_auth(Port *port, int status)
+{
+	char			   *target;
+	MemoryContext		oldcontext;
+
+	if (next_client_auth_hook)
+		(*next_client_auth_hook)(port, status);
+
+	if (status != STATUS_OK)
+		return;
+
+	target = get_login_role_target(port->user_name);
+	if (target == NULL)
+		return;
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	pending_state = palloc0(sizeof(SetUserXactState));
+	pending_state->username = pstrdup(target);
+
+	/*
+	 * The mapping is configured by the administrator, so a superuser target
+	 * only needs the login role to be in set_user.superuser_allowlist.
+	 */
+	set_user_prepare_transition(get_role_oid(port->user_name, false), true);
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * set_user_free_state
+ *
+ * Convenience function for cleaning up transaction state struct.
+ */
+static void
+set_user_free_state(SetUserXactState **state)
+{
+	if (*state != NULL)
+	{
+		(*state)->userid = InvalidOid;
+		pfree(*state);
+		*state = NULL;
+	}
+}
+
+/*
+ * set_user_copy_state
+ *
+ * Return a copy of a transaction state struct in TopMemoryContext, or NULL.
+ */
+static SetUserXactState *
+set_user_copy_state(SetUserXactState *state)
+{
+	SetUserXactState   *copy;
+
+	if (state == NULL)
+		return NULL;
+
+	copy = MemoryContextAlloc(TopMemoryContext, sizeof(SetUserXactState));
+	memcpy(copy, state, sizeof(SetUserXactState));
+	return copy;
+}
+
+/*
+ * set_user_apply_transition
+ *
+ * Perform, log and announce the pending transition. This happens at the end
+ * of the top-level statement which requested it, so that the next statement
+ * of an implicit transaction block or pipeline runs as the new role, or at
+ * pre-commit for transitions requested outside of any statement. The state
+ * from before the first transition of the transaction is kept, so that it can
+ * be restored if the transaction aborts.
+ */
+static void
+set_user_apply_transition(void)
+{
+	MemoryContext oldcontext = NULL;
+
+	if (!xact_start.saved)
+	{
+		/*
+		 * If no transition was in effect, curr_state only holds what this
+		 * transaction found out about the caller; nothing to keep.
+		 */
+		if (prev_state != NULL && prev_state->userid != InvalidOid)
+		{
+			xact_start.curr = set_user_copy_state(curr_state);
+			xact_start.prev = set_user_copy_state(prev_state);
+		}
+		xact_start.roleid = GetCurrentRoleId();
+		xact_start.is_superuser = OidIsValid(xact_start.roleid) &&
+			superuser_arg(xact_start.roleid);
+		strlcpy(xact_start.rolename, curr_state->username, NAMEDATALEN);
+		xact_start.saved = true;
+	}
+	strlcpy(xact_start.applied, pending_state->username, NAMEDATALEN);
+	xact_start.applied_superuser = pending_state->is_superuser;
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	if (pending_state->escalation_id != 0)
+		elog(LOG, "%sRole %s transitioning to %sRole %s under escalation %llu",
+			  curr_state->is_superuser ? su : nsu,
+			  curr_state->username,
+			  pending_state->is_superuser ? su : nsu,
+			  pending_state->username,
+			  (unsigned long long) pending_state->escalation_id);
+	else
+		elog(LOG, "%sRole %s transitioning to %sRole %s",
+			  curr_state->is_superuser ? su : nsu,
+			  curr_state->username,
+			  pending_state->is_superuser ? su : nsu,
+			  pending_state->username);
+
+	set_user_audit_record(is_reset ? "reset_user" : "set_user",
+						  pending_state->username,
+						  pending_state->escalation_id, NULL, NULL);
+
+	/* Do the actual work */
+	SetCurrentRoleId(pending_state->userid, pending_state->is_superuser);
+	PostSetUserHook(is_reset, pending_state->username);
+	QueueDeferredHookEvent(is_reset, pending_state->username);
+
+	/*
+	 * Update GUCs. The role profile goes first, so that it cannot
+	 * override the logging settings.
+	 */
+	set_user_apply_profile(pending_state->profile);
+	SetConfigOption("log_statement", pending_state->log_statement, PGC_SUSET, PGC_S_SESSION);
+	SetConfigOption("log_line_prefix", pending_state->log_prefix, PGC_POSTMASTER, PGC_S_SESSION);
+
+	/* start fresh */
+	if (is_reset)
+	{
+		set_user_free_state(&pending_state);
+		set_user_free_state(&curr_state);
+		set_user_free_state(&prev_state);
+
+		/* always clear is_reset after we've processed it */
+		is_reset = false;
+	}
+	else
+	{
+		prev_state = palloc0(sizeof(SetUserXactState));
+		memcpy(prev_state, curr_state, sizeof(SetUserXactState));
+		set_user_free_state(&curr_state);
+
+		curr_state = palloc0(sizeof(SetUserXactState));
+		memcpy(curr_state, pending_state, sizeof(SetUserXactState));
+		set_user_free_state(&pending_state);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	set_user_report_state();
+}
+
+/*
+ * set_user_report_state
+ *
+ * Update the set_user.active, set_user.target_role and set_user.elevated
+ * settings, which clients are sent when they change. Being set within the
+ * transaction, they are rolled back with it if it aborts.
+ */
+static void
+set_user_report_state(void)
+{
+	bool		active = (curr_state != NULL && prev_state != NULL &&
+						  prev_state->userid != InvalidOid);
+
+	SetConfigOption("set_user.active", active ? "on" : "off",
+					PGC_INTERNAL, PGC_S_OVERRIDE);
+	SetConfigOption("set_user.target_role", active ? curr_state->username : "",
+					PGC_INTERNAL, PGC_S_OVERRIDE);
+	SetConfigOption("set_user.elevated",
+					active && curr_state->is_superuser ? "on" : "off",
+					PGC_INTERNAL, PGC_S_OVERRIDE);
+}
+
+/*
+ * set_user_xact_handler
+ *
+ * Keeps track of variables managed by set_user and ensures proper state during
+ * transaction ABORT.
+ */
+static void
+set_user_xact_handler (XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+			set_user_notify_rollback();
+			set_user_resolve_dirty_procs();
+
+			/* normally applied already, at the end of the statement */
+			if (pending_state != NULL && curr_state != NULL)
+				set_user_apply_transition();
+
+			set_user_audit_flush();
+			break;
+		case XACT_EVENT_COMMIT:
+			set_user_free_state(&xact_start.curr);
+			set_user_free_state(&xact_start.prev);
+			xact_start.saved = false;
+			xact_block_explicit = xact_chain_pending;
+			xact_chain_pending = false;
+
+			PublishDeferredHookEvents();
+			set_user_end_leases(true);
+
+			if (job_wakeup_pending)
+			{
+				job_wakeup_pending = false;
+				if (set_user_shared != NULL && set_user_shared->job_launcher_pid != 0)
+					kill(set_user_shared->job_launcher_pid, SIGUSR1);
+			}
+			break;
+		case XACT_EVENT_ABORT:
+			set_user_free_state(&pending_state);
+
+			/*
+			 * Functions looked at while the transaction ran were cached as the
+			 * transaction saw them, which is no longer true. The others were
+			 * never looked at, so their cache entries still stand.
+			 */
+			if (dirty_procs != NULL)
+			{
+				HASH_SEQ_STATUS	status;
+				DirtyProcEntry *entry;
+
+				hash_seq_init(&status, dirty_procs);
+				while ((entry = (DirtyProcEntry *) hash_seq_search(&status)) != NULL)
+				{
+					if (entry->resolved)
+					{
+						blocked_oids_valid = false;
+						hash_seq_term(&status);
+						break;
+					}
+				}
+				set_user_clear_dirty_procs();
+			}
+
+			/* undo the transitions applied by the aborted transaction */
+			if (xact_start.saved)
+			{
+				const char *restored = xact_start.curr != NULL ?
+					xact_start.curr->username : xact_start.rolename;
+
+				elog(LOG, "%sRole %s transition rolled back to %sRole %s",
+					 xact_start.applied_superuser ? su : nsu,
+					 xact_start.applied,
+					 xact_start.is_superuser ? su : nsu,
+					 restored);
+
+				/* back to no transition at all reads as a reset */
+				rollback_hook_pending = true;
+				rollback_hook_is_reset = (xact_start.curr == NULL);
+				strlcpy(rollback_hook_username, restored, NAMEDATALEN);
+
+				set_user_free_state(&curr_state);
+				set_user_free_state(&prev_state);
+				curr_state = xact_start.curr;
+				prev_state = xact_start.prev;
+				SetCurrentRoleId(xact_start.roleid, xact_start.is_superuser);
+				memset(&xact_start, 0, sizeof(xact_start));
+			}
+			else if (prev_state == NULL || prev_state->userid == InvalidOid)
+			{
+				/*
+				 * Not transitioned, so curr_state can only be left over from a
+				 * transition which failed before it was applied
+				 */
+				set_user_free_state(&curr_state);
+			}
+			xact_block_explicit = xact_chain_pending;
+			xact_chain_pending = false;
+
+			DiscardDeferredHookEvents();
+			set_user_audit_discard();
+			set_user_end_leases(false);
+			job_wakeup_pending = false;
+			is_reset = false;
+			break;
+		case XACT_EVENT_PRE_PREPARE:
+			/* the lease would have to be published by another session */
+			if (lease_pending)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot PREPARE a transaction that has created a set_user lease")));
+
+			/* the events commit or roll back with the prepared transaction */
+			set_user_audit_flush();
+			break;
+		case XACT_EVENT_PREPARE:
+			xact_block_explicit = false;
+			xact_chain_pending = false;
+
+			/* whoever commits it, it is not this session's to announce */
+			DiscardDeferredHookEvents();
+			break;
+		default:
+			break;
+	}
+}
+
+void
+_PG_init(void)
+{
+	DefineCustomBoolVariable("set_user.block_alter_system",
+							 "Block ALTER SYSTEM commands",
+							 NULL, &Block_AS, true, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("set_user.block_copy_program",
+							 "Blocks COPY PROGRAM commands",
+							 NULL, &Block_CP, true, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("set_user.block_log_statement",
+							 "Blocks \"SET log_statement\" commands",
+							 NULL, &Block_LS, true, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	define_allowlist("set_user.nosuperuser_target_allowlist",
+					 "List of roles that can be an argument to set_user",
+					 &NOSU_TargetAllowlist, assign_nosuperuser_target_allowlist,
+					 &NOSU_TargetAllowlistCompiled);
+
+	define_allowlist("set_user.superuser_allowlist",
+					 "Allows a list of users to use set_user_u for superuser escalation",
+					 &SU_Allowlist, assign_superuser_allowlist,
+					 &SU_AllowlistCompiled);
+
+	DefineCustomStringVariable("set_user.superuser_audit_tag",
+							 "Set custom tag for superuser audit escalation",
+							 NULL, &SU_AuditTag, SUPERUSER_AUDIT_TAG, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("set_user.exit_on_error",
+							 "Exit backend process on ERROR during set_session_auth()",
+							 NULL, &exit_on_error, true, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("set_user.login_role_map",
+							 "List of login:target role pairs to transition to at login",
+							 NULL, &Login_RoleMap, "", PGC_SIGHUP,
+							 0, check_login_role_map, assign_login_role_map, NULL);
+
+	DefineCustomStringVariable("set_user.role_profiles",
+							 "List of role:name=value,... settings applied on transition to each role",
+							 NULL, &Role_Profiles, "", PGC_SIGHUP,
+							 0, check_role_profiles, assign_role_profiles, NULL);
+
+	DefineCustomStringVariable("set_user.blocked_internal_functions",
+							 "List of internal functions, in addition to set_config_by_name, blocked after set_user",
+							 NULL, &Blocked_InternalFunctions, "", PGC_SIGHUP,
+							 0, check_blocked_internal_functions,
+							 assign_blocked_internal_functions, NULL);
+
+	DefineCustomEnumVariable("set_user.block_method",
+							 "Method used to recognize blocked functions (catalog or fmgr)",
+							 NULL, &Block_Method, SET_USER_BLOCK_CATALOG,
+							 block_method_options, PGC_POSTMASTER,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomRealVariable("set_user.rate_limit_caller",
+							 "Maximum sustained set_user() calls per second by any one caller role, 0 for no limit",
+							 NULL, &Rate_Limit_Caller, 0, 0, 1000000, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomRealVariable("set_user.rate_limit_target",
+							 "Maximum sustained set_user() calls per second to any one target role, 0 for no limit",
+							 NULL, &Rate_Limit_Target, 0, 0, 1000000, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("set_user.rate_limit_burst",
+							 "Number of set_user() calls allowed in a burst above the rate limits",
+							 NULL, &Rate_Limit_Burst, 10, 1, INT_MAX, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("set_user.job_max_workers",
+							 "Maximum number of set_user jobs run at the same time, 0 to disable the job launcher",
+							 NULL, &Job_MaxWorkers, 0, 0, 1024, PGC_POSTMASTER,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("set_user.deferred_hook_database",
+							 "Database to which the deferred hook worker connects",
+							 NULL, &Deferred_HookDatabase, "postgres", PGC_POSTMASTER,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("set_user.job_database",
+							 "Database in which the job launcher looks for the set_user job queue",
+							 NULL, &Job_Database, "postgres", PGC_POSTMASTER,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("set_user.job_naptime",
+							 "Time between checks of the set_user job queue",
+							 NULL, &Job_Naptime, 10000, 100, INT_MAX, PGC_SIGHUP,
+							 GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("set_user.audit_table",
+							 "Record transitions, and DDL while transitioned, in set_user_audit_log",
+							 NULL, &Audit_Table, false, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	/*
+	 * Reported to clients in ParameterStatus messages whenever they change,
+	 * so that poolers and drivers need not ask
+	 */
+	DefineCustomBoolVariable("set_user.active",
+							 "Shows whether set_user has transitioned the session to another role",
+							 NULL, &Report_Active, false, PGC_INTERNAL,
+							 GUC_REPORT | GUC_NOT_IN_SAMPLE | GUC_DISALLOW_IN_FILE,
+							 NULL, NULL, NULL);
+
+	DefineCustomStringVariable("set_user.target_role",
+							 "Shows the role set_user has transitioned the session to",
+							 NULL, &Report_TargetRole, "", PGC_INTERNAL,
+							 GUC_REPORT | GUC_NOT_IN_SAMPLE | GUC_DISALLOW_IN_FILE,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("set_user.elevated",
+							 "Shows whether set_user has transitioned the session to a superuser",
+							 NULL, &Report_Elevated, false, PGC_INTERNAL,
+							 GUC_REPORT | GUC_NOT_IN_SAMPLE | GUC_DISALLOW_IN_FILE,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("set_user.max_leases",
+							 "Maximum number of set_user escalation leases at any one time",
+							 NULL, &Max_Leases, 16, 0, 1024, PGC_POSTMASTER,
+							 0, NULL, NULL, NULL);
+
+	/* Install hook */
+	prev_hook = ProcessUtility_hook;
+	ProcessUtility_hook = PU_hook;
+
+	/* Object access hook */
+	next_object_access_hook = object_access_hook;
+	object_access_hook = set_user_object_access;
+
+	/* Function manager hooks, used by the fmgr block method */
+	next_needs_fmgr_hook = needs_fmgr_hook;
+	needs_fmgr_hook = set_user_needs_fmgr_hook;
+	next_fmgr_hook = fmgr_hook;
+	fmgr_hook = set_user_fmgr_hook;
+
+	/* Login role transition hook */
+	next_client_auth_hook = ClientAuthentication_hook;
+	ClientAuthentication_hook = set_user_client_auth;
+
+	/* Executor hooks, to apply transitions at the end of each statement */
+	prev_ExecutorRun = ExecutorRun_hook;
+	ExecutorRun_hook = set_user_ExecutorRun;
+	prev_ExecutorFinish = ExecutorFinish_hook;
+	ExecutorFinish_hook = set_user_ExecutorFinish;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = set_user_ExecutorEnd;
+
+	RegisterXactCallback(set_user_xact_handler, NULL);
+
+	/*
+	 * Loaded within a transaction block, e.g. by the first call of set_user(),
+	 * the BEGIN was not seen. Treat the block as explicit; at worst, set_user()
+	 * is refused in the rest of an implicit one.
+	 */
+	xact_block_explicit = IsTransactionBlock();
+
+	/* Shared memory is only available when loaded at server start */
+	if (process_shared_preload_libraries_in_progress)
+	{
+#if PG_VERSION_NUM >= 150000
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = set_user_shmem_request;
+#else
+		set_user_shmem_request();
+#endif
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = set_user_shmem_startup;
+
+		/*
+		 * Libraries later in shared_preload_libraries may register deferred
+		 * hooks, so start the worker regardless; it exits for good if there
+		 * are none.
+		 */
+		{
+			BackgroundWorker	worker;
+
+			memset(&worker, 0, sizeof(worker));
+			worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+			worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+			worker.bgw_restart_time = 10;
+			snprintf(worker.bgw_library_name, BGW_MAXLEN, "set_user");
+			snprintf(worker.bgw_function_name, BGW_MAXLEN, "set_user_hook_worker_main");
+			snprintf(worker.bgw_name, BGW_MAXLEN, "set_user deferred hook worker");
+			snprintf(worker.bgw_type, BGW_MAXLEN, "set_user deferred hook worker");
+			RegisterBackgroundWorker(&worker);
+		}
+
+		if (Job_MaxWorkers > 0)
+		{
+			BackgroundWorker	worker;
+
+			memset(&worker, 0, sizeof(worker));
+			worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+			worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+			worker.bgw_restart_time = 10;
+			snprintf(worker.bgw_library_name, BGW_MAXLEN, "set_user");
+			snprintf(worker.bgw_function_name, BGW_MAXLEN, "set_user_job_launcher_main");
+			snprintf(worker.bgw_name, BGW_MAXLEN, "set_user job launcher");
+			snprintf(worker.bgw_type, BGW_MAXLEN, "set_user job launcher");
+			RegisterBackgroundWorker(&worker);
+		}
+	}
+}
+
+/*
+ * set_user_shmem_request
+ *
+ * Reserve the shared memory used by set_user.
+ */
+static void
+set_user_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(set_user_shmem_size());
+	RequestNamedLWLockTranche("set_user", 2);
+}
+
+/*
+ * set_user_shmem_size
+ *
+ * Size of the shared memory used by set_user.
+ */
+static Size
+set_user_shmem_size(void)
+{
+	return MAXALIGN(add_size(offsetof(SetUserSharedState, leases),
+							 mul_size(Max_Leases, sizeof(SetUserLease))));
+}
+
+/*
+ * set_user_shmem_startup
+ *
+ * Attach to, and on first use initialize, the shared memory used by set_user.
+ */
+static void
+set_user_shmem_startup(void)
+{
+	bool	found;
+	int		i;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	set_user_shared = ShmemInitStruct("set_user", set_user_shmem_size(), &found);
+	set_user_lease_lock = &(GetNamedLWLockTranche("set_user"))[0].lock;
+	set_user_hook_lock = &(GetNamedLWLockTranche("set_user"))[1].lock;
+	if (!found)
+	{
+		for (i = 0; i < SET_USER_RATE_SLOTS; i++)
+		{
+			pg_atomic_init_u64(&set_user_shared->caller_tat[i], 0);
+			pg_atomic_init_u64(&set_user_shared->target_tat[i], 0);
+		}
+		pg_atomic_init_u64(&set_user_shared->caller_rejected, 0);
+		pg_atomic_init_u64(&set_user_shared->target_rejected, 0);
+		set_user_shared->job_launcher_pid = 0;
+		pg_atomic_init_u64(&set_user_shared->next_escalation_id, 1);
+		set_user_shared->hook_worker_pid = 0;
+		set_user_shared->hook_head = 0;
+		set_user_shared->hook_tail = 0;
+		for (i = 0; i < Max_Leases; i++)
+			set_user_shared->leases[i].handle[0] = '\0';
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * set_user_rate_check
+ *
+ * Take a token from the bucket `tat`, returning false if it is empty. This is
+ * the generic cell rate algorithm: `tat` is the time at which the bucket
+ * will be full again, each call pushes it `1 / rate` seconds further into the
+ * future, and a call is refused if that would put it more than `burst` calls
+ * ahead of now. Since the whole bucket is one 64-bit value, a compare and
+ * swap is all the synchronization needed.
+ */
+static bool
+set_user_rate_check(pg_atomic_uint64 *tat, double rate, int burst)
+{
+	uint64		now = (uint64) GetCurrentTimestamp();
+	double		usecs = USECS_PER_SEC / rate;
+	uint64		interval;
+	uint64		tolerance;
+	uint64		oldtat;
+	uint64		newtat;
+
+	if (usecs >= (double) SET_USER_RATE_MAX_USECS)
+		interval = SET_USER_RATE_MAX_USECS;
+	else if (usecs < 1)
+		interval = 1;
+	else
+		interval = (uint64) usecs;
+
+	if ((uint64) burst > SET_USER_RATE_MAX_USECS / interval)
+		tolerance = SET_USER_RATE_MAX_USECS;
+	else
+		tolerance = interval * burst;
+
+	oldtat = pg_atomic_read_u64(tat);
+	for (;;)
+	{
+		newtat = Max(oldtat, now) + interval;
+		if (newtat > now + tolerance)
+			return false;
+
+		/* on failure, oldtat is updated to the current value; try again */
+		if (pg_atomic_compare_exchange_u64(tat, &oldtat, newtat))
+			return true;
+	}
+}
+
+/*
+ * set_user_rate_limit
+ *
+ * Enforce set_user.rate_limit_caller and set_user.rate_limit_target for a
+ * transition from callerId to targetId, counting refused calls.
+ */
+static void
+set_user_rate_limit(Oid callerId, Oid targetId)
+{
+	uint32		slot;
+
+	/* Not loaded at server start, so no shared state to work with */
+	if (set_user_shared == NULL)
+		return;
+
+	if (Rate_Limit_Caller > 0)
+	{
+		slot = hash_uint32((uint32) callerId) % SET_USER_RATE_SLOTS;
+		if (!set_user_rate_check(&set_user_shared->caller_tat[slot],
+								 Rate_Limit_Caller, Rate_Limit_Burst))
+		{
+			pg_atomic_fetch_add_u64(&set_user_shared->caller_rejected, 1);
+			ereport(ERROR,
+					(errcode(ERRCODE_SET_USER_RATE_LIMITED),
+					 errmsg("set_user rate limit exceeded for caller role \"%s\"",
+							GetUserNameFromId(callerId, false)),
+					 errhint("Retry later, or raise set_user.rate_limit_caller.")));
+		}
+	}
+
+	/* a target which does not exist is reported by the caller */
+	if (Rate_Limit_Target > 0 && OidIsValid(targetId))
+	{
+		slot = hash_uint32((uint32) targetId) % SET_USER_RATE_SLOTS;
+		if (!set_user_rate_check(&set_user_shared->target_tat[slot],
+								 Rate_Limit_Target, Rate_Limit_Burst))
+		{
+			pg_atomic_fetch_add_u64(&set_user_shared->target_rejected, 1);
+			ereport(ERROR,
+					(errcode(ERRCODE_SET_USER_RATE_LIMITED),
+					 errmsg("set_user rate limit exceeded for target role \"%s\"",
+							GetUserNameFromId(targetId, false)),
+					 errhint("Retry later, or raise set_user.rate_limit_target.")));
+		}
+	}
+}
+
+/*
+ * Report the number of set_user() calls refused by the rate limits since
+ * server start.
+ */
+PG_FUNCTION_INFO_V1(set_user_rate_limit_stats);
+Datum
+set_user_rate_limit_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[2];
+	bool		nulls[2] = {false, false};
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (set_user_shared != NULL)
+	{
+		values[0] = Int64GetDatum((int64) pg_atomic_read_u64(&set_user_shared->caller_rejected));
+		values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&set_user_shared->target_rejected));
+	}
+	else
+	{
+		values[0] = Int64GetDatum(0);
+		values[1] = Int64GetDatum(0);
+	}
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * set_user_random_token
+ *
+ * Generate an unguessable token of SET_USER_TOKEN_LEN hex digits.
+ */
+static void
+set_user_random_token(char *token)
+{
+	uint8		buf[SET_USER_TOKEN_LEN / 2];
+	int			i;
+
+	if (!pg_strong_random(buf, sizeof(buf)))
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("could not generate random token")));
+
+	for (i = 0; i < sizeof(buf); i++)
+		sprintf(&token[i * 2], "%02x", buf[i]);
+}
+
+/*
+ * set_user_lookup_function
+ *
+ * Return the Oid of setfunc(text) in the extension's schema, nspid.
+ */
+static Oid
+set_user_lookup_function(Oid nspid, const char *setfunc)
+{
+	char	   *nspname = get_namespace_name(nspid);
+	Oid			argtypes[1] = {TEXTOID};
+
+	return LookupFuncName(list_make2(makeString(nspname), makeString(pstrdup(setfunc))),
+						  1, argtypes, false);
+}
+
+/*
+ * set_user_missing_execute
+ *
+ * Return NULL if userid may execute a function which can make the transition
+ * to roleid, set_user_u() for a superuser and either set_user() or
+ * set_user_u() otherwise, or the name of the function to grant if not. nspid
+ * is the extension's schema.
+ */
+static const char *
+set_user_missing_execute(Oid nspid, Oid userid, Oid roleid)
+{
+	if (set_user_may_execute(nspid, "set_user_u", userid))
+		return NULL;
+
+	if (superuser_arg(roleid))
+		return "set_user_u";
+
+	if (set_user_may_execute(nspid, "set_user", userid))
+		return NULL;
+
+	return "set_user";
+}
+
+/*
+ * set_user_may_execute
+ *
+ * Return whether userid may execute setfunc(text) in the extension's schema,
+ * nspid. A function which does not exist, e.g. in an older version of the
+ * extension, cannot be executed.
+ */
+static bool
+set_user_may_execute(Oid nspid, const char *setfunc, Oid userid)
+{
+	char	   *nspname = get_namespace_name(nspid);
+	Oid			argtypes[1] = {TEXTOID};
+	Oid			funcOid;
+
+	if (nspname == NULL)
+		return false;
+
+	funcOid = LookupFuncName(list_make2(makeString(nspname), makeString(pstrdup(setfunc))),
+							 1, argtypes, true);
+
+	return OidIsValid(funcOid) &&
+		_pg_proc_aclcheck(funcOid, userid, ACL_EXECUTE) == ACLCHECK_OK;
+}
+
+/*
+ * Evaluate, for each (callers[i], targets[i]) pair, whether caller may
+ * transition to target: it must have EXECUTE on set_user_u(text) for a
+ * superuser target, or either function otherwise, and pass the allowlist for
+ * that kind of target. The allowlists are only parsed when they are set, and
+ * the functions are looked up once per call, so each pair only costs the
+ * role lookups and membership checks.
+ */
+PG_FUNCTION_INFO_V1(set_user_check);
+Datum
+set_user_check(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	ArrayType	   *callers = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType	   *targets = PG_GETARG_ARRAYTYPE_P(1);
+	Datum		   *caller_elems;
+	Datum		   *target_elems;
+	bool		   *caller_nulls;
+	bool		   *target_nulls;
+	int				ncallers;
+	int				ntargets;
+	Oid				set_user_oid;
+	Oid				set_user_u_oid;
+	TupleDesc		tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext	oldcontext;
+	int				i;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	deconstruct_array(callers, TEXTOID, -1, false, TYPALIGN_INT,
+					  &caller_elems, &caller_nulls, &ncallers);
+	deconstruct_array(targets, TEXTOID, -1, false, TYPALIGN_INT,
+					  &target_elems, &target_nulls, &ntargets);
+	if (ncallers != ntargets)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("callers and targets must have the same number of elements")));
+
+	set_user_oid = set_user_lookup_function(get_func_namespace(fcinfo->flinfo->fn_oid),
+											"set_user");
+	set_user_u_oid = set_user_lookup_function(get_func_namespace(fcinfo->flinfo->fn_oid),
+											  "set_user_u");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = CreateTupleDescCopy(tupdesc);
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < ncallers; i++)
+	{
+		Datum		values[4];
+		bool		nulls[4] = {false, false, false, false};
+		char	   *caller = NULL;
+		char	   *target = NULL;
+		Oid			callerId = InvalidOid;
+		Oid			targetId = InvalidOid;
+		char	   *detail = NULL;
+
+		if (caller_nulls[i])
+			nulls[0] = true;
+		else
+		{
+			caller = TextDatumGetCString(caller_elems[i]);
+			callerId = get_role_oid(caller, true);
+			values[0] = caller_elems[i];
+		}
+
+		if (target_nulls[i])
+			nulls[1] = true;
+		else
+		{
+			target = TextDatumGetCString(target_elems[i]);
+			targetId = get_role_oid(target, true);
+			values[1] = target_elems[i];
+		}
+
+		if (caller == NULL || target == NULL)
+			detail = "caller and target must not be NULL";
+		else if (!OidIsValid(callerId))
+			detail = psprintf("role \"%s\" does not exist", caller);
+		else if (!OidIsValid(targetId))
+			detail = psprintf("role \"%s\" does not exist", target);
+		else if (superuser_arg(targetId))
+		{
+			if (_pg_proc_aclcheck(set_user_u_oid, callerId, ACL_EXECUTE) != ACLCHECK_OK)
+				detail = "caller lacks EXECUTE on set_user_u(text)";
+			else if (!check_user_allowlist(callerId, SU_AllowlistCompiled))
+				detail = "caller is not in set_user.superuser_allowlist";
+		}
+		else
+		{
+			if (_pg_proc_aclcheck(set_user_oid, callerId, ACL_EXECUTE) != ACLCHECK_OK &&
+				_pg_proc_aclcheck(set_user_u_oid, callerId, ACL_EXECUTE) != ACLCHECK_OK)
+				detail = "caller lacks EXECUTE on set_user(text) and set_user_u(text)";
+			else if (!check_user_allowlist(targetId, NOSU_TargetAllowlistCompiled))
+				detail = "target is not in set_user.nosuperuser_target_allowlist";
+		}
+
+		values[2] = BoolGetDatum(detail == NULL);
+		if (detail != NULL)
+			values[3] = CStringGetTextDatum(detail);
+		else
+			nulls[3] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * set_user_end_leases
+ *
+ * Publish the leases created by the transaction which is committing, or drop
+ * them if it aborted, so that a lease exists only if its creation committed.
+ */
+static void
+set_user_end_leases(bool commit)
+{
+	int			i;
+
+	if (!lease_pending)
+		return;
+	lease_pending = false;
+
+	LWLockAcquire(set_user_lease_lock, LW_EXCLUSIVE);
+	for (i = 0; i < Max_Leases; i++)
+	{
+		SetUserLease *slot = &set_user_shared->leases[i];
+
+		if (slot->creator_pid != MyProcPid)
+			continue;
+
+		if (commit)
+			slot->creator_pid = 0;
+		else
+			memset(slot, 0, sizeof(SetUserLease));
+	}
+	LWLockRelease(set_user_lease_lock);
+}
+
+/*
+ * Create an escalation lease: check once that the current user may
+ * transition to `rolename`, and return a handle with which any session of the
+ * current user can then transition to it with set_user_attach_lease(), until
+ * `duration` has passed. All such transitions are logged under the lease's
+ * escalation id.
+ */
+PG_FUNCTION_INFO_V1(set_user_create_lease);
+Datum
+set_user_create_lease(PG_FUNCTION_ARGS)
+{
+	char	   *rolname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	Interval   *duration = PG_GETARG_INTERVAL_P(1);
+	Oid			callerId = GetUserId();
+	Oid			targetId = get_role_oid(rolname, false);
+	bool		target_is_superuser = superuser_arg(targetId);
+	TimestampTz	now = GetCurrentTimestamp();
+	TimestampTz	expires;
+	SetUserLease *lease = NULL;
+	char		handle[SET_USER_TOKEN_LEN + 1];
+	const char *setfunc;
+	uint64		escalation_id;
+	int			i;
+
+	if (set_user_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("set_user leases require set_user in shared_preload_libraries")));
+
+	setfunc = set_user_missing_execute(get_func_namespace(fcinfo->flinfo->fn_oid),
+									   GetUserId(), targetId);
+	if (setfunc != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("permission denied to create set_user lease for role \"%s\"",
+						rolname),
+				 errhint("Creating this lease requires EXECUTE on %s(text).", setfunc)));
+
+	set_user_check_allowlists(callerId, targetId, target_is_superuser, true);
+	set_user_rate_limit(callerId, targetId);
+
+	expires = DatumGetTimestampTz(DirectFunctionCall2(timestamptz_pl_interval,
+													  TimestampTzGetDatum(now),
+													  PointerGetDatum(duration)));
+	if (expires <= now)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("set_user lease duration must be positive")));
+
+	set_user_random_token(handle);
+	escalation_id = pg_atomic_fetch_add_u64(&set_user_shared->next_escalation_id, 1);
+
+	/* take an unused slot, or one whose lease has expired */
+	LWLockAcquire(set_user_lease_lock, LW_EXCLUSIVE);
+	for (i = 0; i < Max_Leases; i++)
+	{
+		SetUserLease *slot = &set_user_shared->leases[i];
+
+		if (slot->handle[0] == '\0' || slot->expires <= now)
+		{
+			lease = slot;
+			strlcpy(lease->handle, handle, sizeof(lease->handle));
+			lease->caller = callerId;
+			lease->target = targetId;
+			lease->is_superuser = target_is_superuser;
+			lease->expires = expires;
+			lease->escalation_id = escalation_id;
+			lease->creator_pid = MyProcPid;
+			break;
+		}
+	}
+	LWLockRelease(set_user_lease_lock);
+
+	if (lease != NULL)
+		lease_pending = true;
+
+	if (lease == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				 errmsg("too many set_user leases"),
+				 errhint("Wait for a lease to expire, or raise set_user.max_leases.")));
+
+	elog(LOG, "%sRole %s created escalation %llu to %sRole %s, expiring at %s",
+		 superuser_arg(callerId) ? su : nsu,
+		 GetUserNameFromId(callerId, false),
+		 (unsigned long long) escalation_id,
+		 target_is_superuser ? su : nsu,
+		 rolname,
+		 timestamptz_to_str(expires));
+
+	PG_RETURN_TEXT_P(cstring_to_text(handle));
+}
+
+/*
+ * Transition to the role of an escalation lease created by the current user.
+ * The allowlists were checked when the lease was created, so they are not
+ * evaluated again; otherwise this behaves like set_user(), and is undone with
+ * reset_user().
+ */
+PG_FUNCTION_INFO_V1(set_user_attach_lease);
+Datum
+set_user_attach_lease(PG_FUNCTION_ARGS)
+{
+	char	   *handle = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	Oid			callerId = GetUserId();
+	TimestampTz	now = GetCurrentTimestamp();
+	SetUserLease lease;
+	bool		found = false;
+	MemoryContext oldcontext;
+	int			i;
+
+	if ((xact_block_explicit && IsTransactionBlock()) || IsSubTransaction())
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set_user: \"set_user_attach_lease()\" not allowed within transaction block"),
+				 errhint("Use \"set_user_attach_lease()\" outside transaction block instead.")));
+	}
+
+	if (set_user_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("set_user leases require set_user in shared_preload_libraries")));
+
+	if (prev_state != NULL && prev_state->userid != InvalidOid)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("must reset previous user prior to setting again")));
+	}
+
+	LWLockAcquire(set_user_lease_lock, LW_SHARED);
+	for (i = 0; i < Max_Leases; i++)
+	{
+		SetUserLease *slot = &set_user_shared->leases[i];
+
+		if (slot->handle[0] != '\0' && slot->expires > now &&
+			slot->creator_pid == 0 && strcmp(slot->handle, handle) == 0)
+		{
+			memcpy(&lease, slot, sizeof(SetUserLease));
+			found = true;
+			break;
+		}
+	}
+	LWLockRelease(set_user_lease_lock);
+
+	if (!found || lease.caller != callerId)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("set_user lease does not exist, has expired, or belongs to another role")));
+
+	/* Switch to a persistent memory context to store state */
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	pending_state = palloc0(sizeof(SetUserXactState));
+	pending_state->userid = lease.target;
+	pending_state->username = GetUserNameFromId(lease.target, false);
+	pending_state->is_superuser = superuser_arg(lease.target);
+	pending_state->escalation_id = lease.escalation_id;
+
+	/* the checks made at creation do not cover a role since made superuser */
+	if (pending_state->is_superuser && !lease.is_superuser)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("role \"%s\" has become a superuser since the lease was created",
+						pending_state->username)));
+
+	set_user_prepare_state(callerId);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_TEXT_P(cstring_to_text("OK"));
+}
+
+/*
+ * set_user_job_schema
+ *
+ * Return the quoted name of the schema holding the job queue, or NULL if the
+ * extension is not installed in this database, or is too old to have a job
+ * queue; that is logged once, and the launcher keeps polling until it is
+ * installed or updated. Must be called in a transaction.
+ */
+static char *
+set_user_job_schema(void)
+{
+	static bool	missing_logged = false;
+	Oid			extoid = get_extension_oid("set_user", true);
+	Oid			nspid = InvalidOid;
+
+	if (OidIsValid(extoid))
+		nspid = get_extension_schema(extoid);
+
+	if (!OidIsValid(nspid) ||
+		!OidIsValid(get_relname_relid("set_user_job_queue", nspid)))
+	{
+		if (!missing_logged)
+			ereport(LOG,
+					(errmsg("set_user job queue not found in database \"%s\"",
+							Job_Database),
+					 errhint("Install or update the set_user extension in set_user.job_database to run jobs.")));
+		missing_logged = true;
+		return NULL;
+	}
+
+	missing_logged = false;
+	return (char *) quote_identifier(get_namespace_name(nspid));
+}
+
+/*
+ * set_user_job_begin / set_user_job_end
+ *
+ * Bracket the launcher's own work on the job queue, each in a transaction of
+ * its own.
+ */
+static void
+set_user_job_begin(void)
+{
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+}
+
+static void
+set_user_job_end(void)
+{
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+}
+
+/*
+ * set_user_job_finish
+ *
+ * Record the outcome of a job in the queue.
+ */
+static void
+set_user_job_finish(int64 jobid, const char *status, const char *error)
+{
+	char	   *schema;
+	Oid			argtypes[3] = {INT8OID, TEXTOID, TEXTOID};
+	Datum		values[3];
+	char		nulls[3] = {' ', ' ', ' '};
+
+	set_user_job_begin();
+
+	schema = set_user_job_schema();
+	if (schema != NULL)
+	{
+		values[0] = Int64GetDatum(jobid);
+		values[1] = CStringGetTextDatum(status);
+		if (error != NULL)
+			values[2] = CStringGetTextDatum(error);
+		else
+			nulls[2] = 'n';
+
+		SPI_execute_with_args(psprintf("UPDATE %s.set_user_job_queue"
+									   " SET status = $2, error = $3, finished_at = now()"
+									   " WHERE id = $1", schema),
+							  3, argtypes, values, nulls, false, 0);
+	}
+
+	set_user_job_end();
+}
+
+/*
+ * set_user_job_reap
+ *
+ * Record the outcome of every job whose worker has exited, and free its slot.
+ */
+static void
+set_user_job_reap(SetUserJobSlot *slots)
+{
+	int			i;
+
+	for (i = 0; i < Job_MaxWorkers; i++)
+	{
+		SetUserJobSlot *slot = &slots[i];
+		SetUserJob *job;
+		pid_t		pid;
+
+		if (slot->handle == NULL ||
+			GetBackgroundWorkerPid(slot->handle, &pid) != BGWH_STOPPED)
+			continue;
+
+		job = (SetUserJob *) dsm_segment_address(slot->seg);
+		if (job->succeeded)
+			set_user_job_finish(slot->jobid, "succeeded", NULL);
+		else
+			set_user_job_finish(slot->jobid, "failed",
+								job->error[0] != '\0' ? job->error :
+								"job worker exited unexpectedly");
+
+		dsm_detach(slot->seg);
+		pfree(slot->handle);
+		memset(slot, 0, sizeof(SetUserJobSlot));
+	}
+}
+
+/*
+ * set_user_job_dispatch
+ *
+ * Claim queued jobs and start a worker for each, while there are free slots.
+ * The job is handed to its worker in a dynamic shared memory segment, which
+ * the worker also uses to report back.
+ */
+static void
+set_user_job_dispatch(SetUserJobSlot *slots)
+{
+	int			i;
+
+	for (i = 0; i < Job_MaxWorkers; i++)
+	{
+		SetUserJobSlot *slot = &slots[i];
+		char	   *schema;
+		HeapTuple	tuple;
+		TupleDesc	tupdesc;
+		bool		isnull;
+		int64		jobid;
+		Oid			dboid;
+		Oid			roleid;
+		Oid			submitter;
+		const char *setfunc;
+		char	   *command;
+		SetUserJob *job;
+		dsm_segment *seg;
+		BackgroundWorker worker;
+
+		if (slot->handle != NULL)
+			continue;
+
+		set_user_job_begin();
+
+		schema = set_user_job_schema();
+		if (schema == NULL)
+		{
+			set_user_job_end();
+			return;
+		}
+
+		SPI_execute(psprintf("UPDATE %s.set_user_job_queue"
+							 " SET status = 'running', started_at = now()"
+							 " WHERE id = (SELECT id FROM %s.set_user_job_queue"
+							 " WHERE status = 'queued' ORDER BY id LIMIT 1"
+							 " FOR UPDATE SKIP LOCKED)"
+							 " RETURNING id, dbname, rolname, submitted_by, command",
+							 schema, schema),
+					false, 0);
+
+		if (SPI_processed == 0)
+		{
+			set_user_job_end();
+			return;
+		}
+
+		tuple = SPI_tuptable->vals[0];
+		tupdesc = SPI_tuptable->tupdesc;
+		jobid = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+		dboid = get_database_oid(SPI_getvalue(tuple, tupdesc, 2), true);
+		roleid = get_role_oid(SPI_getvalue(tuple, tupdesc, 3), true);
+		submitter = get_role_oid(SPI_getvalue(tuple, tupdesc, 4), true);
+		command = SPI_getvalue(tuple, tupdesc, 5);
+
+		/* nothing to run; record why */
+		if (!OidIsValid(dboid) || !OidIsValid(roleid) || !OidIsValid(submitter))
+		{
+			set_user_job_end();
+			set_user_job_finish(jobid, "failed",
+								"database or role of the job does not exist");
+			continue;
+		}
+
+		/* EXECUTE may have been revoked from the submitter since */
+		setfunc = set_user_missing_execute(get_extension_schema(get_extension_oid("set_user", true)),
+										   submitter, roleid);
+		if (setfunc != NULL)
+		{
+			char		error[128];
+
+			snprintf(error, sizeof(error),
+					 "permission denied: running this job requires EXECUTE on %s(text)",
+					 setfunc);
+			set_user_job_end();
+			set_user_job_finish(jobid, "failed", error);
+			continue;
+		}
+
+		seg = dsm_create(offsetof(SetUserJob, command) + strlen(command) + 1, 0);
+		dsm_pin_mapping(seg);
+		job = (SetUserJob *) dsm_segment_address(seg);
+		job->jobid = jobid;
+		job->dboid = dboid;
+		job->roleid = roleid;
+		job->submitter = submitter;
+		job->succeeded = false;
+		job->error[0] = '\0';
+		strcpy(job->command, command);
+
+		set_user_job_end();
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = BGW_NEVER_RESTART;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "set_user");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "set_user_job_worker_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "set_user job %lld", (long long) jobid);
+		snprintf(worker.bgw_type, BGW_MAXLEN, "set_user job");
+		worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+		worker.bgw_notify_pid = MyProcPid;
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &slot->handle))
+		{
+			/* out of background worker slots; put the job back and retry later */
+			slot->handle = NULL;
+			dsm_detach(seg);
+
+			set_user_job_begin();
+			schema = set_user_job_schema();
+			if (schema != NULL)
+				SPI_execute(psprintf("UPDATE %s.set_user_job_queue"
+									 " SET status = 'queued', started_at = NULL"
+									 " WHERE id = %lld", schema, (long long) jobid),
+							false, 0);
+			set_user_job_end();
+			return;
+		}
+
+		slot->jobid = jobid;
+		slot->seg = seg;
+	}
+}
+
+/*
+ * set_user_job_launcher_exit
+ *
+ * Stop set_user_submit_job() from signalling a launcher which is gone.
+ */
+static void
+set_user_job_launcher_exit(int code, Datum arg)
+{
+	set_user_shared->job_launcher_pid = 0;
+}
+
+/*
+ * set_user_job_launcher_main
+ *
+ * Entry point of the job launcher. It polls the job queue in
+ * set_user.job_database, and runs up to set_user.job_max_workers jobs at a
+ * time, each in a worker of its own.
+ */
+void
+set_user_job_launcher_main(Datum main_arg)
+{
+	SetUserJobSlot *slots;
+	char	   *schema;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(Job_Database, NULL, 0);
+
+	set_user_shared->job_launcher_pid = MyProcPid;
+	before_shmem_exit(set_user_job_launcher_exit, 0);
+
+	slots = MemoryContextAllocZero(TopMemoryContext,
+								   sizeof(SetUserJobSlot) * Job_MaxWorkers);
+
+	/* jobs which were running when the server stopped will never finish */
+	set_user_job_begin();
+	schema = set_user_job_schema();
+	if (schema != NULL)
+		SPI_execute(psprintf("UPDATE %s.set_user_job_queue"
+							 " SET status = 'failed', finished_at = now(),"
+							 " error = 'interrupted by server restart'"
+							 " WHERE status = 'running'", schema),
+					false, 0);
+	set_user_job_end();
+
+	for (;;)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		set_user_job_reap(slots);
+		set_user_job_dispatch(slots);
+		pgstat_report_activity(STATE_IDLE, NULL);
+
+		/* woken early by set_user_submit_job() and by exiting workers */
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 Job_Naptime, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+	}
+}
+
+/*
+ * set_user_job_execute
+ *
+ * Run the statements of a job, each in a transaction of its own and as a
+ * top level statement, so that commands such as VACUUM which cannot run in a
+ * transaction block work as they would in psql.
+ */
+static void
+set_user_job_execute(SetUserJob *job)
+{
+	List	   *parsetree_list;
+	ListCell   *l;
+
+	parsetree_list = pg_parse_query(job->command);
+
+	foreach(l, parsetree_list)
+	{
+		RawStmt    *parsetree = lfirst_node(RawStmt, l);
+		CommandTag	commandTag = CreateCommandTag(parsetree->stmt);
+		bool		snapshot_set = false;
+		List	   *querytree_list;
+		List	   *plantree_list;
+		Portal		portal;
+		DestReceiver *receiver;
+		int16		format = 0;
+		QueryCompletion qc;
+
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+
+		if (analyze_requires_snapshot(parsetree))
+		{
+			PushActiveSnapshot(GetTransactionSnapshot());
+			snapshot_set = true;
+		}
+
+		querytree_list = pg_analyze_and_rewrite_fixedparams(parsetree, job->command,
+															NULL, 0, NULL);
+		plantree_list = pg_plan_queries(querytree_list, job->command,
+										CURSOR_OPT_PARALLEL_OK, NULL);
+
+		if (snapshot_set)
+			PopActiveSnapshot();
+
+		portal = CreatePortal("", true, true);
+		portal->visible = false;
+		PortalDefineQuery(portal, NULL, job->command, commandTag, plantree_list, NULL);
+		PortalStart(portal, NULL, 0, InvalidSnapshot);
+		PortalSetResultFormat(portal, 1, &format);
+
+		receiver = CreateDestReceiver(DestNone);
+		InitializeQueryCompletion(&qc);
+		(void) _PortalRun(portal, FETCH_ALL, true, receiver, receiver, &qc);
+		receiver->rDestroy(receiver);
+		PortalDrop(portal, false);
+
+		CommitTransactionCommand();
+	}
+}
+
+/*
+ * set_user_job_worker_main
+ *
+ * Entry point of a job worker. The worker connects as the role which
+ * submitted the job, transitions to the job's role exactly as set_user() or
+ * set_user_u() would, runs the job, and transitions back. The transition
+ * carries a reset token which is never revealed, so the job itself cannot
+ * undo it.
+ */
+void
+set_user_job_worker_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	SetUserJob *job;
+	MemoryContext oldcontext;
+	char		token[SET_USER_TOKEN_LEN + 1];
+
+	BackgroundWorkerUnblockSignals();
+
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map dynamic shared memory segment")));
+	job = (SetUserJob *) dsm_segment_address(seg);
+
+	set_user_random_token(token);
+
+	BackgroundWorkerInitializeConnectionByOid(job->dboid, job->submitter, 0);
+
+	PG_TRY();
+	{
+		/* transition, as set_user() would */
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		pending_state = palloc0(sizeof(SetUserXactState));
+		pending_state->username = GetUserNameFromId(job->roleid, false);
+		pending_state->reset_token = pstrdup(token);
+		set_user_rate_limit(job->submitter, job->roleid);
+		set_user_prepare_transition(job->submitter, superuser_arg(job->roleid));
+		MemoryContextSwitchTo(oldcontext);
+		CommitTransactionCommand();
+
+		ereport(LOG,
+				(errmsg("set_user job %lld running as role \"%s\": %s",
+						(long long) job->jobid, curr_state->username, job->command)));
+		set_user_job_execute(job);
+
+		/* and back again, as reset_user() would */
+		StartTransactionCommand();
+		oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		pending_state = palloc0(sizeof(SetUserXactState));
+		set_user_prepare_reset();
+		is_reset = true;
+		MemoryContextSwitchTo(oldcontext);
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		/* report the error back to the launcher, then exit as usual */
+		MemoryContextSwitchTo(TopMemoryContext);
+		edata = CopyErrorData();
+		strlcpy(job->error, edata->message, sizeof(job->error));
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	job->succeeded = true;
+}
+
+/*
+ * Queue a job for the job launcher: run `command` in database `dbname`,
+ * transitioned to role `rolname`, on behalf of the current user. The current
+ * user must be allowed to execute set_user_u() (for a superuser target) or
+ * set_user(); the allowlists are checked when the job runs.
+ */
+PG_FUNCTION_INFO_V1(set_user_submit_job);
+Datum
+set_user_submit_job(PG_FUNCTION_ARGS)
+{
+	Name		dbname = PG_GETARG_NAME(0);
+	Name		rolname = PG_GETARG_NAME(1);
+	text	   *command = PG_GETARG_TEXT_PP(2);
+	Oid			funcOid = fcinfo->flinfo->fn_oid;
+	Oid			roleid = get_role_oid(NameStr(*rolname), false);
+	Oid			nspid = get_func_namespace(funcOid);
+	char	   *nspname = get_namespace_name(nspid);
+	const char *setfunc = set_user_missing_execute(nspid, GetUserId(), roleid);
+	Oid			argtypes[4] = {NAMEOID, NAMEOID, NAMEOID, TEXTOID};
+	Datum		values[4];
+	NameData	submitter;
+	HeapTuple	procTup;
+	Oid			owner;
+	Oid			save_userid;
+	int			save_sec_context;
+	bool		isnull;
+	int64		jobid;
+
+	if (setfunc != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("permission denied to submit set_user job as role \"%s\"",
+						NameStr(*rolname)),
+				 errhint("Submitting this job requires EXECUTE on %s(text).", setfunc)));
+
+	/* only the job launcher's database is polled for jobs */
+	if (MyDatabaseId != get_database_oid(Job_Database, true))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set_user jobs must be submitted in database \"%s\"",
+						Job_Database),
+				 errhint("The job itself may run in any database; see set_user.job_database.")));
+
+	/* fail now rather than when the job runs */
+	(void) get_database_oid(NameStr(*dbname), false);
+
+	namestrcpy(&submitter, GetUserNameFromId(GetUserId(), false));
+
+	/* The queue is not writable by PUBLIC; insert as the function owner */
+	procTup = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcOid));
+	if (!HeapTupleIsValid(procTup))
+		elog(ERROR, "cache lookup failed for function %u", funcOid);
+	owner = ((Form_pg_proc) GETSTRUCT(procTup))->proowner;
+	ReleaseSysCache(procTup);
+
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(owner, save_sec_context |
+						   SECURITY_LOCAL_USERID_CHANGE |
+						   SECURITY_RESTRICTED_OPERATION);
+
+	values[0] = NameGetDatum(dbname);
+	values[1] = NameGetDatum(rolname);
+	values[2] = NameGetDatum(&submitter);
+	values[3] = PointerGetDatum(command);
+
+	SPI_connect();
+	if (SPI_execute_with_args(psprintf("INSERT INTO %s.set_user_job_queue"
+									   " (dbname, rolname, submitted_by, command)"
+									   " VALUES ($1, $2, $3, $4) RETURNING id",
+									   quote_identifier(nspname)),
+							  4, argtypes, values, NULL, false, 1) != SPI_OK_INSERT_RETURNING)
+		elog(ERROR, "could not queue set_user job");
+	jobid = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+										SPI_tuptable->tupdesc, 1, &isnull));
+	SPI_finish();
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	/* wake the launcher once the job is visible to it */
+	job_wakeup_pending = true;
+
+	PG_RETURN_INT64(jobid);
+}
+
+void
+_PG_fini(void)
+{
+	ProcessUtility_hook = prev_hook;
+	ExecutorRun_hook = prev_ExecutorRun;
+	ExecutorFinish_hook = prev_ExecutorFinish;
+	ExecutorEnd_hook = prev_ExecutorEnd;
+}
+
+/*
+ * _PU_HOOK
+ *
+ * Compatibility shim for PU_hook. Handles changing function signature
+ * between versions of PostgreSQL.
+ */
+_PU_HOOK
+{
+	set_user_notify_rollback();
+
+	/* if set_user has been used to transition, enforce set_user GUCs */
+	if (curr_state != NULL && curr_state->userid != InvalidOid)
+	{
+		switch (nodeTag((Node *) pstmt->utilityStmt))
+		{
+			case T_AlterSystemStmt:
+				if (Block_AS)
+					ereport(ERROR,
+							(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+							 errmsg("ALTER SYSTEM blocked by set_user config")));
+				break;
+			case T_CopyStmt:
+				if (((CopyStmt *)pstmt->utilityStmt)->is_program && Block_CP)
+					ereport(ERROR,
+							(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+							 errmsg("COPY PROGRAM blocked by set_user config")));
+				break;
+			case T_VariableSetStmt:
+				if ((strcmp(((VariableSetStmt *)pstmt->utilityStmt)->name,
+					 "log_statement") == 0) &&
+					Block_LS)
+				{
+					ereport(ERROR,
+							(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+							 errmsg("\"SET log_statement\" blocked by set_user config")));
+				}
+				else if ((strcmp(((VariableSetStmt *)pstmt->utilityStmt)->name,
+					 "role") == 0))
+				{
+					ereport(ERROR,
+							(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+							 errmsg("\"SET/RESET ROLE\" blocked by set_user"),
+							 errhint("Use \"SELECT set_user();\" or \"SELECT reset_user();\" instead.")));
+				}
+				else if ((strcmp(((VariableSetStmt *)pstmt->utilityStmt)->name,
+					 "session_authorization") == 0))
+				{
+					ereport(ERROR,
+							(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+							 errmsg("\"SET/RESET SESSION AUTHORIZATION\" blocked by set_user"),
+							 errhint("Use \"SELECT set_user();\" or \"SELECT reset_user();\" instead.")));
+				}
+				break;
+			case T_DiscardStmt:
+				/*
+				 * DISCARD ALL resets the session authorization, so it must not
+				 * become a way around a reset token.
+				 */
+				if (((DiscardStmt *)pstmt->utilityStmt)->target == DISCARD_ALL &&
+					prev_state != NULL && prev_state->reset_token)
+				{
+					ereport(ERROR,
+							(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+							 errmsg("\"DISCARD ALL\" blocked by set_user"),
+							 errhint("Use \"SELECT reset_user('token');\" first.")));
+				}
+				break;
+			default:
+				break;
+		}
+	}
+
+	/* set_user() is not allowed once an explicit transaction block begins */
+	if (nodeTag((Node *) pstmt->utilityStmt) == T_TransactionStmt)
+	{
+		TransactionStmt *stmt = (TransactionStmt *) pstmt->utilityStmt;
+
+		switch (stmt->kind)
+		{
+			case TRANS_STMT_BEGIN:
+			case TRANS_STMT_START:
+				xact_block_explicit = true;
+				break;
+			case TRANS_STMT_COMMIT:
+			case TRANS_STMT_ROLLBACK:
+				/*
+				 * The chained block starts once the transaction ends. Ending an
+				 * already aborted one fires no abort event, so set the flag now
+				 * as well.
+				 */
+				xact_chain_pending = stmt->chain;
+				if (stmt->chain)
+					xact_block_explicit = true;
+				break;
+			default:
+				break;
+		}
+	}
+
+	/*
+	 * Now pass-off handling either to the previous ProcessUtility hook
+	 * or to the standard ProcessUtility.
+	 *
+	 * These functions are also called by their compatibility variants.
+	 */
+	exec_nested_level++;
+	PG_TRY();
+	{
+		if (prev_hook)
+		{
+			_prev_hook;
+		}
+		else
+		{
+			_standard_ProcessUtility;
+		}
+	}
+	PG_FINALLY();
+	{
+		exec_nested_level--;
+	}
+	PG_END_TRY();
+
+	/* Record DDL run while transitioned; subcommands are part of a statement */
+	if (Audit_Table && curr_state != NULL && curr_state->userid != InvalidOid &&
+		context != PROCESS_UTILITY_SUBCOMMAND &&
+		GetCommandLogLevel(pstmt->utilityStmt) == LOGSTMT_DDL)
+	{
+		char	   *statement = NULL;
+
+		if (queryString != NULL)
+		{
+			int			location = pstmt->stmt_location;
+			int			len = pstmt->stmt_len;
+
+			/* as in pg_stat_statements, -1/0 mean the whole string */
+			if (location < 0)
+				location = 0;
+			if (len <= 0)
+				len = strlen(queryString + location);
+			statement = pnstrdup(queryString + location, len);
+		}
+
+		set_user_audit_record("ddl", NULL, curr_state->escalation_id,
+							  GetCommandTagName(CreateCommandTag(pstmt->utilityStmt)),
+							  statement);
+	}
+
+	/* DISCARD ALL succeeded, so drop whatever set_user state is left */
+	if (nodeTag((Node *) pstmt->utilityStmt) == T_DiscardStmt &&
+		((DiscardStmt *)pstmt->utilityStmt)->target == DISCARD_ALL)
+	{
+		set_user_discard_all();
+	}
+
+	/* a top-level statement has ended, e.g. DO or CALL */
+	set_user_statement_end();
+}
+
+/*
+ * set_user_statement_end
+ *
+ * Apply a transition requested by the top-level statement which has just
+ * ended, so that the following statements of the transaction run as the new
+ * role. Portals can also be closed while a transaction aborts, when there is
+ * nothing left to apply.
+ */
+static void
+set_user_statement_end(void)
+{
+	if (exec_nested_level == 0 && pending_state != NULL && curr_state != NULL &&
+		IsTransactionState())
+		set_user_apply_transition();
+}
+
+/*
+ * _EXECUTORRUN_HOOK
+ *
+ * Track the nesting depth, so that set_user_ExecutorEnd can tell the end of
+ * a top-level statement from the end of a query run inside a function.
+ */
+_EXECUTORRUN_HOOK
+{
+	if (exec_nested_level == 0)
+		set_user_notify_rollback();
+
+	exec_nested_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorRun)
+			_prev_ExecutorRun;
+		else
+			_standard_ExecutorRun;
+	}
+	PG_FINALLY();
+	{
+		exec_nested_level--;
+	}
+	PG_END_TRY();
+}
+
+/*
+ * set_user_ExecutorFinish
+ *
+ * Nested queries may also run while AFTER triggers fire.
+ */
+static void
+set_user_ExecutorFinish(QueryDesc *queryDesc)
+{
+	exec_nested_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorFinish)
+			prev_ExecutorFinish(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
+	}
+	PG_FINALLY();
+	{
+		exec_nested_level--;
+	}
+	PG_END_TRY();
+}
+
+/*
+ * set_user_ExecutorEnd
+ *
+ * A top-level query, such as "SELECT set_user('bob')", has ended.
+ */
+static void
+set_user_ExecutorEnd(QueryDesc *queryDesc)
+{
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+
+	set_user_statement_end();
+}
+
+/*
+ * set_user_audit_record
+ *
+ * Buffer an event for set_user_audit_log, if set_user.audit_table is on. The
+ * events of a transaction are written together at commit.
+ */
+static void
+set_user_audit_record(const char *event_type, const char *target_role,
+					  uint64 escalation_id, const char *command_tag,
+					  const char *statement)
+{
+	SetUserAuditEvent  *event;
+	MemoryContext		oldcontext;
+
+	if (!Audit_Table)
+		return;
+
+	if (audit_context == NULL)
+		audit_context = AllocSetContextCreate(TopMemoryContext,
+											  "set_user audit events",
+											  ALLOCSET_DEFAULT_SIZES);
+
+	oldcontext = MemoryContextSwitchTo(audit_context);
+
+	event = palloc0(sizeof(SetUserAuditEvent));
+	event->event_time = GetCurrentTimestamp();
+	event->event_type = event_type;
+	event->session_role = GetUserNameFromId(GetSessionUserId(), false);
+	event->acting_role = GetUserNameFromId(GetUserId(), false);
+	event->target_role = target_role ? pstrdup(target_role) : NULL;
+	event->escalation_id = escalation_id;
+	event->command_tag = command_tag ? pstrdup(command_tag) : NULL;
+	event->statement = statement ? pstrdup(statement) : NULL;
+	audit_events = lappend(audit_events, event);
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * set_user_audit_flush
+ *
+ * Write the buffered audit events to set_user_audit_log, with one INSERT per
+ * SET_USER_AUDIT_BATCH events, as the owner of the table. Called at
+ * pre-commit or pre-prepare, so the events commit or abort with the
+ * transaction.
+ */
+static void
+set_user_audit_flush(void)
+{
+	Oid			extoid;
+	Oid			relid = InvalidOid;
+	HeapTuple	classTup;
+	Oid			owner;
+	char	   *schema;
+	Oid			save_userid;
+	int			save_sec_context;
+	ListCell   *l;
+	int			nevents;
+	int			i;
+
+	if (audit_events == NIL)
+		return;
+
+	/* a standby has nowhere to write them */
+	if (RecoveryInProgress())
+	{
+		audit_carried = 0;
+		set_user_audit_discard();
+		return;
+	}
+
+	/*
+	 * Transitions made at login are committed before the session can run
+	 * queries, and read-only transactions cannot insert; keep the events for
+	 * the next transaction which can.
+	 */
+	if (!IsNormalProcessingMode() || XactReadOnly)
+	{
+		nevents = list_length(audit_events);
+		if (nevents > SET_USER_AUDIT_MAX_CARRIED)
+		{
+			ereport(WARNING,
+					(errmsg("%d set_user audit events dropped",
+							nevents - SET_USER_AUDIT_MAX_CARRIED),
+					 errdetail("At most %d events are kept until a transaction can write them to set_user_audit_log.",
+							   SET_USER_AUDIT_MAX_CARRIED)));
+			set_user_audit_keep(SET_USER_AUDIT_MAX_CARRIED);
+		}
+		audit_carried = list_length(audit_events);
+		return;
+	}
+
+	extoid = get_extension_oid("set_user", true);
+	if (OidIsValid(extoid))
+		relid = get_relname_relid("set_user_audit_log", get_extension_schema(extoid));
+
+	/* nowhere to write them in this database */
+	if (!OidIsValid(relid))
+	{
+		audit_carried = 0;
+		set_user_audit_discard();
+		return;
+	}
+
+	classTup = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(classTup))
+		elog(ERROR, "cache lookup failed for relation %u", relid);
+	owner = ((Form_pg_class) GETSTRUCT(classTup))->relowner;
+	ReleaseSysCache(classTup);
+
+	schema = (char *) quote_identifier(get_namespace_name(get_extension_schema(extoid)));
+
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(owner, save_sec_context |
+						   SECURITY_LOCAL_USERID_CHANGE |
+						   SECURITY_RESTRICTED_OPERATION);
+
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	l = list_head(audit_events);
+	nevents = list_length(audit_events);
+	for (i = 0; i < nevents; i += SET_USER_AUDIT_BATCH)
+	{
+		int			nrows = Min(nevents - i, SET_USER_AUDIT_BATCH);
+		int			nargs = nrows * 8;
+		Oid		   *argtypes = palloc(nargs * sizeof(Oid));
+		Datum	   *values = palloc(nargs * sizeof(Datum));
+		char	   *nulls = palloc(nargs * sizeof(char));
+		StringInfoData sql;
+		int			row;
+
+		initStringInfo(&sql);
+		appendStringInfo(&sql, "INSERT INTO %s.set_user_audit_log"
+						 " (event_time, backend_pid, session_role, acting_role,"
+						 " event_type, target_role, escalation_id, command_tag, statement)"
+						 " VALUES", schema);
+
+		for (row = 0; row < nrows; row++)
+		{
+			SetUserAuditEvent *event = (SetUserAuditEvent *) lfirst(l);
+			int			p = row * 8;
+
+			appendStringInfo(&sql, "%s ($%d, %d, $%d, $%d, $%d, $%d, $%d, $%d, $%d)",
+							 row == 0 ? "" : ",",
+							 p + 1, MyProcPid, p + 2, p + 3, p + 4,
+							 p + 5, p + 6, p + 7, p + 8);
+
+			memset(nulls + p, ' ', 8);
+			argtypes[p] = TIMESTAMPTZOID;
+			values[p] = TimestampTzGetDatum(event->event_time);
+			argtypes[p + 1] = TEXTOID;
+			values[p + 1] = CStringGetTextDatum(event->session_role);
+			argtypes[p + 2] = TEXTOID;
+			values[p + 2] = CStringGetTextDatum(event->acting_role);
+			argtypes[p + 3] = TEXTOID;
+			values[p + 3] = CStringGetTextDatum(event->event_type);
+			argtypes[p + 4] = TEXTOID;
+			if (event->target_role)
+				values[p + 4] = CStringGetTextDatum(event->target_role);
+			else
+				nulls[p + 4] = 'n';
+			argtypes[p + 5] = INT8OID;
+			if (event->escalation_id != 0)
+				values[p + 5] = Int64GetDatum((int64) event->escalation_id);
+			else
+				nulls[p + 5] = 'n';
+			argtypes[p + 6] = TEXTOID;
+			if (event->command_tag)
+				values[p + 6] = CStringGetTextDatum(event->command_tag);
+			else
+				nulls[p + 6] = 'n';
+			argtypes[p + 7] = TEXTOID;
+			if (event->statement)
+				values[p + 7] = CStringGetTextDatum(event->statement);
+			else
+				nulls[p + 7] = 'n';
+
+			l = lnext(audit_events, l);
+		}
+
+		if (SPI_execute_with_args(sql.data, nargs, argtypes, values, nulls,
+								  false, 0) != SPI_OK_INSERT)
+			elog(ERROR, "could not write set_user audit events");
+	}
+
+	PopActiveSnapshot();
+	SPI_finish();
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	audit_carried = 0;
+	set_user_audit_discard();
+}
+
+/*
+ * set_user_audit_discard
+ *
+ * Drop the audit events of the current transaction, which has aborted or
+ * written them, keeping any carried over from the startup transaction.
+ */
+static void
+set_user_audit_discard(void)
+{
+	set_user_audit_keep(audit_carried);
+}
+
+/*
+ * set_user_audit_keep
+ *
+ * Drop all but the first nkeep audit events. The ones kept are copied to a
+ * fresh memory context, so that the memory of the others is freed with the
+ * old one rather than held until no events are left.
+ */
+static void
+set_user_audit_keep(int nkeep)
+{
+	MemoryContext	newcontext;
+	MemoryContext	oldcontext;
+	List		   *kept = NIL;
+	ListCell	   *l;
+
+	if (nkeep >= list_length(audit_events))
+		return;
+
+	if (nkeep == 0)
+	{
+		audit_events = NIL;
+		MemoryContextReset(audit_context);
+		return;
+	}
+
+	newcontext = AllocSetContextCreate(TopMemoryContext,
+									   "set_user audit events",
+									   ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(newcontext);
+
+	foreach(l, audit_events)
+	{
+		SetUserAuditEvent *event = (SetUserAuditEvent *) lfirst(l);
+		SetUserAuditEvent *copy;
+
+		if (foreach_current_index(l) >= nkeep)
+			break;
+
+		copy = palloc(sizeof(SetUserAuditEvent));
+		memcpy(copy, event, sizeof(SetUserAuditEvent));
+		copy->session_role = pstrdup(event->session_role);
+		copy->acting_role = pstrdup(event->acting_role);
+		copy->target_role = event->target_role ? pstrdup(event->target_role) : NULL;
+		copy->command_tag = event->command_tag ? pstrdup(event->command_tag) : NULL;
+		copy->statement = event->statement ? pstrdup(event->statement) : NULL;
+		kept = lappend(kept, copy);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(audit_context);
+	audit_context = newcontext;
+	audit_events = kept;
+}
+
+/*
+ * set_user_discard_all
+ *
+ * DISCARD ALL has already reset the session authorization and all GUCs, but
+ * curr_state/prev_state still describe the old transition. Queue a reset to
+ * the session user so the transaction handler logs the transition and clears
+ * the state (including any reset token) at commit, leaving the backend fit to
+ * be handed to another client by a connection pooler.
+ */
+static void
+set_user_discard_all(void)
+{
+	MemoryContext	oldcontext;
+
+	if (curr_state == NULL || prev_state == NULL || prev_state->userid == InvalidOid)
+		return;
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	set_user_free_state(&pending_state);
+	pending_state = palloc0(sizeof(SetUserXactState));
+	pending_state->userid = GetSessionUserId();
+	pending_state->username = GetUserNameFromId(pending_state->userid, false);
+	pending_state->log_statement = prev_state->log_statement;
+	pending_state->log_prefix = prev_state->log_prefix;
+	pending_state->is_superuser = superuser_arg(pending_state->userid);
+	is_reset = true;
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * PostSetUserHook
+ *
+ * Handler for set_user post hooks
+ */
+void
+PostSetUserHook(bool is_reset, const char *username)
+{
+	List		  **hooks_queue;
+	ListCell	   *hooks_entry = NULL;
+
+	hooks_queue = (List **) find_rendezvous_variable(SET_USER_HOOKS_KEY);
+	foreach (hooks_entry, *hooks_queue)
+	{
+		SetUserHooks	**post_hooks = (SetUserHooks **) lfirst(hooks_entry);
+		if (post_hooks)
+		{
+			if (!is_reset && (*post_hooks)->post_set_user)
+			{
+				(*post_hooks)->post_set_user(username);
+			}
+			else if ((*post_hooks)->post_reset_user)
+			{
+				(*post_hooks)->post_reset_user();
+			}
+		}
 	}
-	else
-		/* should not happen */
-		elog(ERROR, "unexpected argument combination");
-
-	MemoryContextSwitchTo(oldcontext);
-	PG_RETURN_TEXT_P(cstring_to_text("OK"));
 }
 
 /*
- * set_user_free_state
+ * set_user_notify_rollback
  *
- * Convenience function for cleaning up transaction state struct.
+ * Tell the in-process hooks about the role restored by a transaction which
+ * rolled back a transition, once a transaction is running again. The deferred
+ * hooks need not be told, as they only hear of committed transitions.
  */
 static void
-set_user_free_state(SetUserXactState **state)
+set_user_notify_rollback(void)
 {
-	if (*state != NULL)
-	{
-		(*state)->userid = InvalidOid;
-		pfree(*state);
-		*state = NULL;
-	}
+	if (!rollback_hook_pending || !IsTransactionState() ||
+		IsAbortedTransactionBlockState())
+		return;
+
+	rollback_hook_pending = false;
+	PostSetUserHook(rollback_hook_is_reset, rollback_hook_username);
 }
 
 /*
- * set_user_xact_handler
+ * QueueDeferredHookEvent
  *
- * Keeps track of variables managed by set_user and ensures proper state during
- * transaction ABORT.
+ * Remember a transition for the deferred hooks, if any are registered. The
+ * event is handed to the deferred hook worker at commit, or discarded if the
+ * transaction aborts after all. Without shared memory there is no worker to
+ * hand it to.
  */
 static void
-set_user_xact_handler (XactEvent event, void *arg)
+QueueDeferredHookEvent(bool is_reset, const char *username)
 {
-	MemoryContext oldcontext = NULL;
-
-	switch (event)
-	{
-		case XACT_EVENT_PRE_COMMIT:
-			if (pending_state == NULL || curr_state == NULL)
-				return;
-
-			oldcontext = MemoryContextSwitchTo(TopMemoryContext);
-			elog(LOG, "%sRole %s transitioning to %sRole %s",
-				  curr_state->is_superuser ? su : nsu,
-				  curr_state->username,
-				  pending_state->is_superuser ? su : nsu,
-				  pending_state->username);
-
-			/* Do the actual work */
-			SetCurrentRoleId(pending_state->userid, pending_state->is_superuser);
-			PostSetUserHook(is_reset, pending_state->username);
-
-			/* Update GUCs */
-			SetConfigOption("log_statement", pending_state->log_statement, PGC_SUSET, PGC_S_SESSION);
-			SetConfigOption("log_line_prefix", pending_state->log_prefix, PGC_POSTMASTER, PGC_S_SESSION);
-
-			/* start fresh */
-			if (is_reset)
-			{
-				set_user_free_state(&pending_state);
-				set_user_free_state(&curr_state);
-				set_user_free_state(&prev_state);
+	List			  **hooks_queue;
+	SetUserHookEvent   *event;
+	MemoryContext		oldcontext;
 
-				/* always clear is_reset after we've processed it */
-				is_reset = false;
-			}
-			else
-			{
-				prev_state = palloc0(sizeof(SetUserXactState));
-				memcpy(prev_state, curr_state, sizeof(SetUserXactState));
-				set_user_free_state(&curr_state);
+	if (set_user_shared == NULL)
+		return;
 
-				curr_state = palloc0(sizeof(SetUserXactState));
-				memcpy(curr_state, pending_state, sizeof(SetUserXactState));
-				set_user_free_state(&pending_state);
-			}
+	hooks_queue = (List **) find_rendezvous_variable(SET_USER_DEFERRED_HOOKS_KEY);
+	if (*hooks_queue == NIL)
+		return;
 
-			MemoryContextSwitchTo(oldcontext);
-			break;
-		case XACT_EVENT_ABORT:
-			set_user_free_state(&pending_state);
-			is_reset = false;
-			break;
-		default:
-			break;
-	}
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	event = palloc0(sizeof(SetUserHookEvent));
+	event->is_reset = is_reset;
+	event->session_userid = GetSessionUserId();
+	strlcpy(event->username, username, NAMEDATALEN);
+	deferred_events = lappend(deferred_events, event);
+	MemoryContextSwitchTo(oldcontext);
 }
 
-void
-_PG_init(void)
+/*
+ * PublishDeferredHookEvents
+ *
+ * Hand the transitions of the transaction which just committed to the
+ * deferred hook worker. This only copies them to shared memory, so the hooks
+ * add nothing to the commit. If the worker has fallen too far behind, the
+ * events which do not fit are dropped with a warning; it is too late for an
+ * error.
+ */
+static void
+PublishDeferredHookEvents(void)
 {
-	DefineCustomBoolVariable("set_user.block_alter_system",
-							 "Block ALTER SYSTEM commands",
-							 NULL, &Block_AS, true, PGC_SIGHUP,
-							 0, NULL, NULL, NULL);
-
-	DefineCustomBoolVariable("set_user.block_copy_program",
-							 "Blocks COPY PROGRAM commands",
-							 NULL, &Block_CP, true, PGC_SIGHUP,
-							 0, NULL, NULL, NULL);
-
-	DefineCustomBoolVariable("set_user.block_log_statement",
-							 "Blocks \"SET log_statement\" commands",
-							 NULL, &Block_LS, true, PGC_SIGHUP,
-							 0, NULL, NULL, NULL);
+	ListCell   *event_entry;
+	int			dropped = 0;
 
-	DefineCustomStringVariable("set_user.nosuperuser_target_allowlist",
-							 "List of roles that can be an argument to set_user",
-							 NULL, &NOSU_TargetAllowlist, ALLOWLIST_WILDCARD, PGC_SIGHUP,
-							 0, NULL, NULL, NULL);
+	if (deferred_events == NIL)
+		return;
 
-	DefineCustomStringVariable("set_user.superuser_allowlist",
-							 "Allows a list of users to use set_user_u for superuser escalation",
-							 NULL, &SU_Allowlist, ALLOWLIST_WILDCARD, PGC_SIGHUP,
-							 0, NULL, NULL, NULL);
+	LWLockAcquire(set_user_hook_lock, LW_EXCLUSIVE);
+	foreach (event_entry, deferred_events)
+	{
+		SetUserHookEvent   *event = (SetUserHookEvent *) lfirst(event_entry);
 
-	DefineCustomStringVariable("set_user.superuser_audit_tag",
-							 "Set custom tag for superuser audit escalation",
-							 NULL, &SU_AuditTag, SUPERUSER_AUDIT_TAG, PGC_SIGHUP,
-							 0, NULL, NULL, NULL);
+		if (set_user_shared->hook_head - set_user_shared->hook_tail >= SET_USER_HOOK_QUEUE_SIZE)
+		{
+			dropped++;
+			continue;
+		}
 
-	DefineCustomBoolVariable("set_user.exit_on_error",
-							 "Exit backend process on ERROR during set_session_auth()",
-							 NULL, &exit_on_error, true, PGC_SIGHUP,
-							 0, NULL, NULL, NULL);
+		memcpy(&set_user_shared->hook_events[set_user_shared->hook_head % SET_USER_HOOK_QUEUE_SIZE],
+			   event, sizeof(SetUserHookEvent));
+		set_user_shared->hook_head++;
+	}
+	LWLockRelease(set_user_hook_lock);
 
-	/* Install hook */
-	prev_hook = ProcessUtility_hook;
-	ProcessUtility_hook = PU_hook;
+	DiscardDeferredHookEvents();
 
-	/* Object access hook */
-	next_object_access_hook = object_access_hook;
-	object_access_hook = set_user_object_access;
+	if (set_user_shared->hook_worker_pid != 0)
+		kill(set_user_shared->hook_worker_pid, SIGUSR1);
 
-	RegisterXactCallback(set_user_xact_handler, NULL);
+	if (dropped > 0)
+		ereport(WARNING,
+				(errmsg("set_user deferred hook queue is full, %d transitions not delivered", dropped)));
 }
 
-void
-_PG_fini(void)
+/*
+ * DiscardDeferredHookEvents
+ *
+ * Drop the events of a transaction which aborted, as its transitions never
+ * took effect, or which have been handed over.
+ */
+static void
+DiscardDeferredHookEvents(void)
 {
-	ProcessUtility_hook = prev_hook;
+	list_free_deep(deferred_events);
+	deferred_events = NIL;
 }
 
 /*
- * _PU_HOOK
+ * set_user_deliver_hook_event
  *
- * Compatibility shim for PU_hook. Handles changing function signature
- * between versions of PostgreSQL.
+ * Call each deferred hook for one committed transition, as the session user
+ * of the backend which made it, each hook in a transaction of its own. A hook
+ * which fails is reported and its transaction rolled back, the way
+ * autovacuum recovers from an error in one table, and the remaining hooks
+ * still run.
  */
-_PU_HOOK
+static void
+set_user_deliver_hook_event(SetUserHookEvent *event)
 {
-	/* if set_user has been used to transition, enforce set_user GUCs */
-	if (curr_state != NULL && curr_state->userid != InvalidOid)
+	List	  **hooks_queue;
+	ListCell   *hooks_entry;
+
+	hooks_queue = (List **) find_rendezvous_variable(SET_USER_DEFERRED_HOOKS_KEY);
+	foreach (hooks_entry, *hooks_queue)
 	{
-		switch (nodeTag((Node *) pstmt->utilityStmt))
+		SetUserHooks   *post_hooks = (SetUserHooks *) lfirst(hooks_entry);
+
+		PG_TRY();
 		{
-			case T_AlterSystemStmt:
-				if (Block_AS)
-					ereport(ERROR,
-							(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-							 errmsg("ALTER SYSTEM blocked by set_user config")));
-				break;
-			case T_CopyStmt:
-				if (((CopyStmt *)pstmt->utilityStmt)->is_program && Block_CP)
-					ereport(ERROR,
-							(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-							 errmsg("COPY PROGRAM blocked by set_user config")));
-				break;
-			case T_VariableSetStmt:
-				if ((strcmp(((VariableSetStmt *)pstmt->utilityStmt)->name,
-					 "log_statement") == 0) &&
-					Block_LS)
-				{
-					ereport(ERROR,
-							(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-							 errmsg("\"SET log_statement\" blocked by set_user config")));
-				}
-				else if ((strcmp(((VariableSetStmt *)pstmt->utilityStmt)->name,
-					 "role") == 0))
-				{
-					ereport(ERROR,
-							(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-							 errmsg("\"SET/RESET ROLE\" blocked by set_user"),
-							 errhint("Use \"SELECT set_user();\" or \"SELECT reset_user();\" instead.")));
-				}
-				else if ((strcmp(((VariableSetStmt *)pstmt->utilityStmt)->name,
-					 "session_authorization") == 0))
-				{
-					ereport(ERROR,
-							(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-							 errmsg("\"SET/RESET SESSION AUTHORIZATION\" blocked by set_user"),
-							 errhint("Use \"SELECT set_user();\" or \"SELECT reset_user();\" instead.")));
-				}
-				break;
-			default:
-				break;
+			StartTransactionCommand();
+			PushActiveSnapshot(GetTransactionSnapshot());
+
+			/* the role may have been dropped since */
+			if (SearchSysCacheExists1(AUTHOID, ObjectIdGetDatum(event->session_userid)))
+			{
+				Oid			save_userid;
+				int			save_sec_context;
+
+				/* commit does not restore it; on error, abort does */
+				GetUserIdAndSecContext(&save_userid, &save_sec_context);
+				SetUserIdAndSecContext(event->session_userid,
+									   save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+
+				if (!event->is_reset && post_hooks->post_set_user)
+					post_hooks->post_set_user(event->username);
+				else if (event->is_reset && post_hooks->post_reset_user)
+					post_hooks->post_reset_user();
+
+				SetUserIdAndSecContext(save_userid, save_sec_context);
+			}
+
+			PopActiveSnapshot();
+			CommitTransactionCommand();
+		}
+		PG_CATCH();
+		{
+			HOLD_INTERRUPTS();
+			MemoryContextSwitchTo(TopMemoryContext);
+			EmitErrorReport();
+			AbortOutOfAnyTransaction();
+			FlushErrorState();
+			RESUME_INTERRUPTS();
 		}
+		PG_END_TRY();
 	}
+}
 
-	/*
-	 * Now pass-off handling either to the previous ProcessUtility hook
-	 * or to the standard ProcessUtility.
-	 *
-	 * These functions are also called by their compatibility variants.
-	 */
-	if (prev_hook)
-	{
-		_prev_hook;
-	}
-	else
-	{
-		_standard_ProcessUtility;
-	}
+/*
+ * set_user_hook_worker_exit
+ *
+ * Stop backends from signalling a deferred hook worker which is gone.
+ */
+static void
+set_user_hook_worker_exit(int code, Datum arg)
+{
+	set_user_shared->hook_worker_pid = 0;
 }
 
 /*
- * PostSetUserHook
+ * set_user_hook_worker_main
  *
- * Handler for set_user post hooks
+ * Entry point of the deferred hook worker. It waits for committed
+ * transitions to be queued, and calls the deferred hooks for each, away from
+ * the client's round trip.
  */
 void
-PostSetUserHook(bool is_reset, const char *username)
+set_user_hook_worker_main(Datum main_arg)
 {
-	List		  **hooks_queue;
-	ListCell	   *hooks_entry = NULL;
+	List	  **hooks_queue;
 
-	hooks_queue = (List **) find_rendezvous_variable(SET_USER_HOOKS_KEY);
-	foreach (hooks_entry, *hooks_queue)
+	/*
+	 * The hooks were registered by libraries in shared_preload_libraries,
+	 * so this process has the same ones as any backend. Nothing to do, and
+	 * nothing to restart for, if there are none.
+	 */
+	hooks_queue = (List **) find_rendezvous_variable(SET_USER_DEFERRED_HOOKS_KEY);
+	if (*hooks_queue == NIL)
+		proc_exit(0);
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(Deferred_HookDatabase, NULL, 0);
+
+	set_user_shared->hook_worker_pid = MyProcPid;
+	before_shmem_exit(set_user_hook_worker_exit, 0);
+
+	for (;;)
 	{
-		SetUserHooks	**post_hooks = (SetUserHooks **) lfirst(hooks_entry);
-		if (post_hooks)
+		SetUserHookEvent	event;
+		bool				found = false;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
 		{
-			if (!is_reset && (*post_hooks)->post_set_user)
-			{
-				(*post_hooks)->post_set_user(username);
-			}
-			else if ((*post_hooks)->post_reset_user)
-			{
-				(*post_hooks)->post_reset_user();
-			}
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		LWLockAcquire(set_user_hook_lock, LW_EXCLUSIVE);
+		if (set_user_shared->hook_tail != set_user_shared->hook_head)
+		{
+			memcpy(&event,
+				   &set_user_shared->hook_events[set_user_shared->hook_tail % SET_USER_HOOK_QUEUE_SIZE],
+				   sizeof(SetUserHookEvent));
+			set_user_shared->hook_tail++;
+			found = true;
+		}
+		LWLockRelease(set_user_hook_lock);
+
+		if (found)
+		{
+			set_user_deliver_hook_event(&event);
+			continue;
 		}
+
+		pgstat_report_activity(STATE_IDLE, NULL);
+
+		/* woken by backends committing transitions */
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, -1L,
+						 PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
 	}
 }
 
@@ -671,40 +3868,114 @@ PostSetUserHook(bool is_reset, const char *username)
  *
  * 1. does not require superuser (GRANTable)
  * 2. does not allow switching to a superuser
- * 3. does not allow reset/switching back
+ * 3. does not allow reset/switching back, unless a reset token is provided,
+ *    in which case only reset_session_auth(token) can switch back
  * 4. Can be configured to throw FATAL/exit for all ERRORs
  */
-PG_FUNCTION_INFO_V1(set_session_auth);
+PG_FUNCTION_INFO_V1(set_session_auth);
+Datum
+set_session_auth(PG_FUNCTION_ARGS)
+{
+	bool orig_exit_on_err = ExitOnAnyError;
+#if NO_ASSERT_AUTH_UID_ONCE
+	char		   *newuser = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char		   *origuser = NULL;
+	char		   *token = NULL;
+	HeapTuple		roleTup;
+	bool			NewUser_is_superuser = false;
+	MemoryContext	oldcontext;
+
+	ExitOnAnyError = exit_on_error;
+
+	/* only one revocable session authorization at a time */
+	if (session_auth_token != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must reset session authorization prior to setting again"),
+				 errhint("Use \"reset_session_auth(token)\" first.")));
+
+	/* with 2 args, the caller wants to be able to switch back */
+	if (PG_NARGS() == 2)
+	{
+		oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		token = text_to_cstring(PG_GETARG_TEXT_PP(1));
+		origuser = GetUserNameFromId(GetSessionUserId(), false);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/* Look up the username */
+	roleTup = SearchSysCache1(AUTHNAME, PointerGetDatum(newuser));
+	if (!HeapTupleIsValid(roleTup))
+		elog(ERROR, "role \"%s\" does not exist", newuser);
+
+	NewUser_is_superuser = ((Form_pg_authid) GETSTRUCT(roleTup))->rolsuper;
+	ReleaseSysCache(roleTup);
+
+	/* cannot escalate to superuser */
+	if (NewUser_is_superuser)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("switching to superuser not allowed"),
+				 errhint("Use \'set_user_u\' to escalate.")));
+
+	_InitializeSessionUserId(newuser, InvalidOid);
+
+	/* Remember who to switch back to, now that the switch has succeeded */
+	session_auth_username = origuser;
+	session_auth_token = token;
+#else
+	ExitOnAnyError = exit_on_error;
+	elog(ERROR, "Assert build disables set_session_auth()");
+#endif
+
+	ExitOnAnyError = orig_exit_on_err;
+	PG_RETURN_TEXT_P(cstring_to_text("OK"));
+}
+
+/*
+ * Undo set_session_auth(rolename, token), restoring the session user that
+ * was in place when it was called. Intended for connection poolers: the
+ * pooler keeps the token to itself, and can then recycle the backend for
+ * another client rather than closing the connection.
+ */
+PG_FUNCTION_INFO_V1(reset_session_auth);
 Datum
-set_session_auth(PG_FUNCTION_ARGS)
+reset_session_auth(PG_FUNCTION_ARGS)
 {
 	bool orig_exit_on_err = ExitOnAnyError;
 #if NO_ASSERT_AUTH_UID_ONCE
-	char		   *newuser = text_to_cstring(PG_GETARG_TEXT_PP(0));
-	HeapTuple		roleTup;
-	bool			NewUser_is_superuser = false;
+	char		   *token = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char		   *origuser = session_auth_username;
 
 	ExitOnAnyError = exit_on_error;
 
-	/* Look up the username */
-	roleTup = SearchSysCache1(AUTHNAME, PointerGetDatum(newuser));
-	if (!HeapTupleIsValid(roleTup))
-		elog(ERROR, "role \"%s\" does not exist", newuser);
+	/* nothing to undo */
+	if (session_auth_token == NULL)
+	{
+		ExitOnAnyError = orig_exit_on_err;
+		PG_RETURN_TEXT_P(cstring_to_text("OK"));
+	}
 
-	NewUser_is_superuser = ((Form_pg_authid) GETSTRUCT(roleTup))->rolsuper;
-	ReleaseSysCache(roleTup);
+	if (strcmp(session_auth_token, token) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("incorrect reset token provided")));
 
-	/* cannot escalate to superuser */
-	if (NewUser_is_superuser)
+	if (curr_state != NULL && curr_state->userid != InvalidOid)
 		ereport(ERROR,
 				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 errmsg("switching to superuser not allowed"),
-				 errhint("Use \'set_user_u\' to escalate.")));
+				 errmsg("must reset previous user prior to resetting session authorization"),
+				 errhint("Use \"SELECT reset_user();\" first.")));
 
-	_InitializeSessionUserId(newuser, InvalidOid);
+	_InitializeSessionUserId(origuser, InvalidOid);
+
+	pfree(session_auth_token);
+	pfree(session_auth_username);
+	session_auth_token = NULL;
+	session_auth_username = NULL;
 #else
 	ExitOnAnyError = exit_on_error;
-	elog(ERROR, "Assert build disables set_session_auth()");
+	elog(ERROR, "Assert build disables reset_session_auth()");
 #endif
 
 	ExitOnAnyError = orig_exit_on_err;
@@ -726,26 +3997,36 @@ set_user_object_access (ObjectAccessType access, Oid classId, Oid objectId, int
 		(*next_object_access_hook)(access, classId, objectId, subId, arg);
 	}
 
-	/* If set_user has been used to transition, enforce `set_config` block. */
+	/* If set_user has been used to transition, enforce the function block. */
 	if (curr_state != NULL && curr_state->userid != InvalidOid)
 	{
 		switch (access)
 		{
 			case OAT_FUNCTION_EXECUTE:
 			{
-				/* Update the `set_config` Oid cache if necessary. */
-				set_user_cache_proc(InvalidOid);
+				/* Build the blocked function Oid cache if necessary. */
+				if (Block_Method == SET_USER_BLOCK_FMGR)
+					set_user_cache_builtins();
+				else
+					set_user_cache_proc(InvalidOid);
 
 				/* Now see if this function is blocked */
-				set_user_block_set_config(objectId);
+				set_user_resolve_proc(objectId);
+				set_user_block_proc(objectId);
 				break;
 			}
 			case OAT_POST_ALTER:
 			case OAT_POST_CREATE:
 			{
-				if (classId == ProcedureRelationId)
+				/*
+				 * The fmgr block method has no Oid cache to maintain. Bulk DDL
+				 * creates functions by the thousand, so only note which ones
+				 * need a look.
+				 */
+				if (classId == ProcedureRelationId &&
+					Block_Method == SET_USER_BLOCK_CATALOG)
 				{
-					set_user_cache_proc(objectId);
+					set_user_mark_proc_dirty(objectId);
 				}
 				break;
 			}
@@ -756,43 +4037,332 @@ set_user_object_access (ObjectAccessType access, Oid classId, Oid objectId, int
 }
 
 /*
- * set_user_block_set_config
+ * check_blocked_internal_functions
+ *
+ * GUC check hook for set_user.blocked_internal_functions. Reject lists which
+ * cannot be parsed, so the name set can always be built from the current value.
+ */
+static bool
+check_blocked_internal_functions(char **newval, void **extra, GucSource source)
+{
+	char	   *rawstring;
+	List	   *elemlist;
+	ListCell   *l;
+
+	rawstring = pstrdup(*newval);
+	if (!SplitIdentifierString(rawstring, ',', &elemlist))
+	{
+		GUC_check_errdetail("List syntax is invalid.");
+		pfree(rawstring);
+		list_free(elemlist);
+		return false;
+	}
+
+	foreach(l, elemlist)
+	{
+		if (strlen((char *) lfirst(l)) >= NAMEDATALEN)
+		{
+			GUC_check_errdetail("Function name \"%s\" is too long.", (char *) lfirst(l));
+			pfree(rawstring);
+			list_free(elemlist);
+			return false;
+		}
+	}
+
+	pfree(rawstring);
+	list_free(elemlist);
+	return true;
+}
+
+/*
+ * assign_blocked_internal_functions
+ *
+ * GUC assign hook for set_user.blocked_internal_functions. The name set and
+ * the Oid cache built from it are stale now; rebuild them on next use.
+ */
+static void
+assign_blocked_internal_functions(const char *newval, void *extra)
+{
+	blocked_names_valid = false;
+	blocked_oids_valid = false;
+}
+
+/*
+ * set_user_build_blocked_names
  *
- * Error out if the provided functionId is in the `set_config_procs` cache.
+ * (Re)build the hash of `prosrc` names which are blocked while transitioned:
+ * `set_config_by_name` plus set_user.blocked_internal_functions.
  */
 static void
-set_user_block_set_config(Oid functionId)
+set_user_build_blocked_names(void)
+{
+	HASHCTL			ctl;
+	char		   *rawstring;
+	List		   *elemlist;
+	ListCell	   *l;
+
+	if (blocked_names_valid)
+		return;
+
+	if (blocked_names != NULL)
+	{
+		hash_destroy(blocked_names);
+		blocked_names = NULL;
+	}
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = NAMEDATALEN;
+	ctl.entrysize = sizeof(BlockedNameEntry);
+	ctl.hcxt = CacheMemoryContext;
+	blocked_names = hash_create("set_user blocked function names", 16, &ctl,
+								HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
+
+	hash_search(blocked_names, set_config_proc_name, HASH_ENTER, NULL);
+
+	/* The check hook has already made sure this parses */
+	rawstring = pstrdup(Blocked_InternalFunctions ? Blocked_InternalFunctions : "");
+	if (SplitIdentifierString(rawstring, ',', &elemlist))
+	{
+		foreach(l, elemlist)
+			hash_search(blocked_names, lfirst(l), HASH_ENTER, NULL);
+	}
+	pfree(rawstring);
+	list_free(elemlist);
+
+	blocked_names_valid = true;
+}
+
+/*
+ * set_user_is_blocked_name
+ *
+ * Is `prosrc` one of the blocked internal function names?
+ */
+static bool
+set_user_is_blocked_name(const char *prosrc)
 {
-	MemoryContext	ctx;
+	/* Longer names cannot be in the hash, and would be truncated by it */
+	if (strlen(prosrc) >= NAMEDATALEN)
+		return false;
+
+	return hash_search(blocked_names, prosrc, HASH_FIND, NULL) != NULL;
+}
 
-	/* This is where we store the set_config Oid cache. */
-	ctx = MemoryContextSwitchTo(CacheMemoryContext);
+/*
+ * set_user_block_proc
+ *
+ * Error out if the provided functionId is in the blocked function Oid cache.
+ */
+static void
+set_user_block_proc(Oid functionId)
+{
+	BlockedProcEntry   *entry;
 
 	/* Check the cache for the current function Oid */
-	if (list_member_oid(set_config_oid_cache, functionId))
+	entry = (BlockedProcEntry *) hash_search(blocked_oids, &functionId, HASH_FIND, NULL);
+	if (entry != NULL)
+		set_user_report_blocked(functionId, entry->is_set_config);
+}
+
+/*
+ * set_user_report_blocked
+ *
+ * Throw the error for an attempt to call a blocked function.
+ */
+static void
+set_user_report_blocked(Oid functionId, bool is_set_config)
+{
+	ObjectAddress	object;
+	char		*funcname = NULL;
+
+	object.classId = ProcedureRelationId;
+	object.objectId = functionId;
+	object.objectSubId = 0;
+
+	funcname = getObjectIdentity(&object);
+	ereport(ERROR,
+			(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+			 errmsg("\"%s\" blocked by set_user", funcname),
+			 is_set_config ? errhint("Use \"SET\" syntax instead.") : 0));
+}
+
+/*
+ * set_user_reset_blocked_oids
+ *
+ * Start the blocked function Oid cache over from an empty set.
+ */
+static void
+set_user_reset_blocked_oids(void)
+{
+	HASHCTL		ctl;
+
+	if (blocked_oids != NULL)
+		hash_destroy(blocked_oids);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(BlockedProcEntry);
+	ctl.hcxt = CacheMemoryContext;
+	blocked_oids = hash_create("set_user blocked function Oids", 16, &ctl,
+							   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/* the new set starts out up to date */
+	set_user_clear_dirty_procs();
+}
+
+/*
+ * set_user_mark_proc_dirty
+ *
+ * Note that a function was created or altered. Nothing to do if the Oid cache
+ * has not been built yet, since the full scan will pick the function up.
+ */
+static void
+set_user_mark_proc_dirty(Oid functionId)
+{
+	DirtyProcEntry *entry;
+
+	if (!blocked_names_valid || !blocked_oids_valid)
+		return;
+
+	if (dirty_procs == NULL)
 	{
-		ObjectAddress	object;
-		char		*funcname = NULL;
+		HASHCTL		ctl;
 
-		object.classId = ProcedureRelationId;
-		object.objectId = functionId;
-		object.objectSubId = 0;
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(DirtyProcEntry);
+		ctl.hcxt = CacheMemoryContext;
+		dirty_procs = hash_create("set_user dirty function Oids", 64, &ctl,
+								  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
 
-		funcname = getObjectIdentity(&object);
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 errmsg("\"%s\" blocked by set_user", funcname),
-				 errhint("Use \"SET\" syntax instead.")));
+	entry = (DirtyProcEntry *) hash_search(dirty_procs, &functionId, HASH_ENTER, NULL);
+	entry->resolved = false;
+}
+
+/*
+ * set_user_resolve_proc
+ *
+ * About to check whether functionId is blocked: bring its cache entry up to
+ * date first if it was created or altered since the cache was.
+ */
+static void
+set_user_resolve_proc(Oid functionId)
+{
+	DirtyProcEntry *entry;
+
+	if (dirty_procs == NULL)
+		return;
+
+	entry = (DirtyProcEntry *) hash_search(dirty_procs, &functionId, HASH_FIND, NULL);
+	if (entry == NULL || entry->resolved)
+		return;
+
+	hash_search(blocked_oids, &functionId, HASH_REMOVE, NULL);
+	set_user_cache_proc(functionId);
+	entry->resolved = true;
+}
+
+/*
+ * set_user_resolve_dirty_procs
+ *
+ * Bring the Oid cache up to date with every function created or altered by
+ * the committing transaction. They are looked up by Oid, unless that would
+ * read more pages than one pass over pg_proc, which scales with the size of
+ * pg_proc rather than with a fixed count.
+ */
+static void
+set_user_resolve_dirty_procs(void)
+{
+	HASH_SEQ_STATUS	status;
+	DirtyProcEntry *entry;
+	long			ndirty = 0;
+	Relation		rel;
+	SysScanDesc		sscan;
+	HeapTuple		procTup;
+
+	if (dirty_procs == NULL)
+		return;
+
+	/* the cache was rebuilt or dropped since, which dealt with them */
+	if (!blocked_names_valid || !blocked_oids_valid)
+	{
+		set_user_clear_dirty_procs();
+		return;
+	}
+
+	/*
+	 * Forget what the cache knew of them, since a function may have been
+	 * dropped. Those looked at already are looked at again, in case a
+	 * subtransaction which changed them rolled back since.
+	 */
+	hash_seq_init(&status, dirty_procs);
+	while ((entry = (DirtyProcEntry *) hash_seq_search(&status)) != NULL)
+	{
+		hash_search(blocked_oids, &entry->procoid, HASH_REMOVE, NULL);
+		ndirty++;
+	}
+
+	rel = table_open(ProcedureRelationId, AccessShareLock);
+
+	if (ndirty * SET_USER_PROC_LOOKUP_PAGES <= (long) RelationGetNumberOfBlocks(rel))
+	{
+		table_close(rel, AccessShareLock);
+
+		hash_seq_init(&status, dirty_procs);
+		while ((entry = (DirtyProcEntry *) hash_seq_search(&status)) != NULL)
+			set_user_cache_proc(entry->procoid);
+	}
+	else
+	{
+		MemoryContext	scancxt;
+		MemoryContext	oldcontext;
+
+		scancxt = AllocSetContextCreate(CurrentMemoryContext,
+										"set_user pg_proc scan",
+										ALLOCSET_DEFAULT_SIZES);
+
+		sscan = systable_beginscan(rel, InvalidOid, false, SnapshotSelf, 0, NULL);
+		while (HeapTupleIsValid(procTup = systable_getnext(sscan)))
+		{
+			Oid		procoid = heap_tuple_get_oid(procTup, ProcedureRelationId);
+
+			if (hash_search(dirty_procs, &procoid, HASH_FIND, NULL) != NULL)
+			{
+				oldcontext = MemoryContextSwitchTo(scancxt);
+				set_user_check_proc(procTup, rel);
+				MemoryContextSwitchTo(oldcontext);
+				MemoryContextReset(scancxt);
+			}
+		}
+		systable_endscan(sscan);
+		table_close(rel, NoLock);
+		MemoryContextDelete(scancxt);
 	}
 
-	MemoryContextSwitchTo(ctx);
+	set_user_clear_dirty_procs();
+}
+
+/*
+ * set_user_clear_dirty_procs
+ *
+ * Forget the functions waiting for set_user_resolve_dirty_procs().
+ */
+static void
+set_user_clear_dirty_procs(void)
+{
+	if (dirty_procs != NULL)
+	{
+		hash_destroy(dirty_procs);
+		dirty_procs = NULL;
+	}
 }
 
 /*
  * set_user_check_proc
  *
  * Check the specified HeapTuple to see if its `prosrc` attribute matches
- * `set_config_by_name`. Update the cache as appropriate:
+ * one of the blocked internal function names. Update the cache as
+ * appropriate:
  *
  * 1) Add to the cache if it's not there but `prosrc` matches.
  *
@@ -801,14 +4371,30 @@ set_user_block_set_config(Oid functionId)
 static void
 set_user_check_proc(HeapTuple procTup, Relation rel)
 {
-	MemoryContext		ctx;
+	Form_pg_proc		procStruct = (Form_pg_proc) GETSTRUCT(procTup);
 	Datum				prosrcdatum;
 	bool				isnull;
 	Oid					procoid;
+	text			   *prosrctext;
+	int					len;
+	char				prosrc[NAMEDATALEN];
+	bool				blocked = false;
 
 	/* For function metadata (Oid) */
 	procoid = heap_tuple_get_oid(procTup, ProcedureRelationId);
 
+	/*
+	 * Only internal and C functions name an internal function in `prosrc`.
+	 * For other languages it is the function body, which can be large and
+	 * toasted, so do not even fetch it.
+	 */
+	if (procStruct->prolang != INTERNALlanguageId &&
+		procStruct->prolang != ClanguageId)
+	{
+		hash_search(blocked_oids, &procoid, HASH_REMOVE, NULL);
+		return;
+	}
+
 	/* Figure out the underlying function */
 	prosrcdatum = heap_getattr(procTup, Anum_pg_proc_prosrc, RelationGetDescr(rel), &isnull);
 	if (isnull)
@@ -819,22 +4405,32 @@ set_user_check_proc(HeapTuple procTup, Relation rel)
 	}
 
 	/*
-	 * The Oid cache is as good as the underlying cache context, so store it
-	 * there.
+	 * Longer names cannot be in the hash, so only shorter ones are copied out
+	 * to be looked up.
 	 */
-	ctx = MemoryContextSwitchTo(CacheMemoryContext);
+	prosrctext = DatumGetTextPP(prosrcdatum);
+	len = VARSIZE_ANY_EXHDR(prosrctext);
+	if (len < NAMEDATALEN)
+	{
+		memcpy(prosrc, VARDATA_ANY(prosrctext), len);
+		prosrc[len] = '\0';
+		blocked = set_user_is_blocked_name(prosrc);
+	}
+	if ((Pointer) prosrctext != DatumGetPointer(prosrcdatum))
+		pfree(prosrctext);
 
 	/* Make sure the Oid cache is up-to-date */
-	if (strcmp(TextDatumGetCString(prosrcdatum), set_config_proc_name) == 0)
+	if (blocked)
 	{
-		set_config_oid_cache = list_append_unique_oid(set_config_oid_cache, procoid);
+		BlockedProcEntry   *entry;
+
+		entry = (BlockedProcEntry *) hash_search(blocked_oids, &procoid, HASH_ENTER, NULL);
+		entry->is_set_config = (strcmp(prosrc, set_config_proc_name) == 0);
 	}
-	else if (list_member_oid(set_config_oid_cache, procoid))
+	else
 	{
-		set_config_oid_cache = list_delete_oid(set_config_oid_cache, procoid);
+		hash_search(blocked_oids, &procoid, HASH_REMOVE, NULL);
 	}
-
-	MemoryContextSwitchTo(ctx);
 }
 
 /*
@@ -843,12 +4439,13 @@ set_user_check_proc(HeapTuple procTup, Relation rel)
  * This function has two modes of operation, based on the provided argument:
  *
  * 1) `functionId` is not set (InvalidOid) - scan all procedures to
- * initialize a list of function Oids which call `set_config_by_name()` under the
- * hood.
+ * initialize the set of function Oids which call one of the blocked internal
+ * functions (such as `set_config_by_name()`) under the hood.
  *
  * 2) `functionId` is a valid Oid - grab the syscache entry for the provided
  * Oid to inspect `prosrc` attribute and determine whether it should be in the
- * `set_config_oid_cache` list.
+ * `blocked_oids` set. Nothing to do if the set has not been built yet, since
+ * the full scan will pick the function up.
  */
 static void
 set_user_cache_proc(Oid functionId)
@@ -862,6 +4459,15 @@ set_user_cache_proc(Oid functionId)
 	Snapshot		snapshot = NULL;
 	int				nkeys = 0;
 	ScanKeyData		skey;
+	MemoryContext	scancxt;
+	MemoryContext	oldcontext;
+
+	/* The Oid cache is only as good as the names it was built from */
+	if (!blocked_names_valid)
+	{
+		set_user_build_blocked_names();
+		blocked_oids_valid = false;
+	}
 
 	/*
 	 * If checking the cache for a specific function Oid, we need to narrow the heap
@@ -869,17 +4475,30 @@ set_user_cache_proc(Oid functionId)
 	 */
 	if (functionId != InvalidOid)
 	{
+		if (!blocked_oids_valid)
+			return;
+
 		indexId = ProcedureOidIndexId;
 		indexOk = true;
 		snapshot = SnapshotSelf;
 		nkeys = 1;
 		ScanKeyInit(&skey, Anum_pg_proc_oid, BTEqualStrategyNumber, F_OIDEQ, ObjectIdGetDatum(functionId));
 	}
-	else if (set_config_oid_cache != NIL)
+	else if (blocked_oids_valid)
 	{
 		/* No need to re-initialize the cache. We've already been here. */
 		return;
 	}
+	else
+	{
+		/* Start the full scan from an empty set */
+		set_user_reset_blocked_oids();
+	}
+
+	/* Whatever checking a row allocates is freed before the next one */
+	scancxt = AllocSetContextCreate(CurrentMemoryContext,
+									"set_user pg_proc scan",
+									ALLOCSET_DEFAULT_SIZES);
 
 	/* Go ahead and do the work */
 	PG_TRY();
@@ -889,13 +4508,16 @@ set_user_cache_proc(Oid functionId)
 
 		/*
 		 * InvalidOid implies complete heap scan to initialize the
-		 * set_config cache.
+		 * blocked function cache.
 		 *
 		 * If we have a scankey, this should only match one item.
 		 */
 		while (HeapTupleIsValid(procTup = systable_getnext(sscan)))
 		{
+			oldcontext = MemoryContextSwitchTo(scancxt);
 			set_user_check_proc(procTup, rel);
+			MemoryContextSwitchTo(oldcontext);
+			MemoryContextReset(scancxt);
 		}
 	}
 	PG_CATCH();
@@ -909,4 +4531,167 @@ set_user_cache_proc(Oid functionId)
 
 	systable_endscan(sscan);
 	table_close(rel, NoLock);
+	MemoryContextDelete(scancxt);
+
+	if (functionId == InvalidOid)
+		blocked_oids_valid = true;
+}
+
+/*
+ * set_user_cache_builtins
+ *
+ * Used by the fmgr block method instead of set_user_cache_proc(). Build the
+ * blocked function Oid cache, and the set of blocked function addresses, from
+ * the table of builtin functions compiled into the server, so no catalog
+ * access is needed. Only builtin functions end up in the Oid cache: fmgr
+ * calls those directly, without consulting any hooks. Everything else is
+ * caught by address in set_user_fmgr_hook().
+ */
+static void
+set_user_cache_builtins(void)
+{
+	HASHCTL			ctl;
+	int				i;
+
+	/* The caches are only as good as the names they were built from */
+	if (!blocked_names_valid)
+	{
+		set_user_build_blocked_names();
+		blocked_oids_valid = false;
+	}
+
+	if (blocked_oids_valid)
+		return;
+
+	set_user_reset_blocked_oids();
+
+	if (blocked_addrs != NULL)
+		hash_destroy(blocked_addrs);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(PGFunction);
+	ctl.entrysize = sizeof(BlockedAddrEntry);
+	ctl.hcxt = CacheMemoryContext;
+	blocked_addrs = hash_create("set_user blocked function addresses", 16, &ctl,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	for (i = 0; i < fmgr_nbuiltins; i++)
+	{
+		const FmgrBuiltin  *fbp = &fmgr_builtins[i];
+		BlockedProcEntry   *procentry;
+		BlockedAddrEntry   *addrentry;
+		bool				is_set_config;
+
+		if (!set_user_is_blocked_name(fbp->funcName))
+			continue;
+
+		is_set_config = (strcmp(fbp->funcName, set_config_proc_name) == 0);
+
+		procentry = (BlockedProcEntry *) hash_search(blocked_oids, &fbp->foid, HASH_ENTER, NULL);
+		procentry->is_set_config = is_set_config;
+
+		addrentry = (BlockedAddrEntry *) hash_search(blocked_addrs, &fbp->func, HASH_ENTER, NULL);
+		addrentry->is_set_config = is_set_config;
+	}
+
+	blocked_oids_valid = true;
+}
+
+/*
+ * set_user_needs_fmgr_hook
+ *
+ * Decide, once per FmgrInfo, whether a function needs set_user_fmgr_hook():
+ * only those which resolve to a blocked builtin function do. Internal
+ * functions resolve by `prosrc` name, C functions are resolved to their
+ * address the same way fmgr will do it.
+ */
+static bool
+set_user_needs_fmgr_hook(Oid functionId)
+{
+	HeapTuple		procTup;
+	Form_pg_proc	procStruct;
+	Datum			datum;
+	bool			isnull;
+	bool			result = false;
+
+	if (next_needs_fmgr_hook && (*next_needs_fmgr_hook)(functionId))
+		return true;
+
+	if (Block_Method != SET_USER_BLOCK_FMGR)
+		return false;
+
+	set_user_cache_builtins();
+
+	procTup = SearchSysCache1(PROCOID, ObjectIdGetDatum(functionId));
+	if (!HeapTupleIsValid(procTup))
+		return false;
+
+	procStruct = (Form_pg_proc) GETSTRUCT(procTup);
+
+	if (procStruct->prolang == INTERNALlanguageId)
+	{
+		char	   *prosrc;
+
+		datum = SysCacheGetAttr(PROCOID, procTup, Anum_pg_proc_prosrc, &isnull);
+		if (!isnull)
+		{
+			prosrc = TextDatumGetCString(datum);
+			result = set_user_is_blocked_name(prosrc);
+			pfree(prosrc);
+		}
+	}
+	else if (procStruct->prolang == ClanguageId)
+	{
+		char	   *probin;
+		char	   *prosrc;
+		PGFunction	addr;
+
+		datum = SysCacheGetAttr(PROCOID, procTup, Anum_pg_proc_probin, &isnull);
+		if (!isnull)
+		{
+			probin = TextDatumGetCString(datum);
+			datum = SysCacheGetAttr(PROCOID, procTup, Anum_pg_proc_prosrc, &isnull);
+			if (!isnull)
+			{
+				prosrc = TextDatumGetCString(datum);
+				addr = load_external_function(probin, prosrc, false, NULL);
+				result = (addr != NULL &&
+						  hash_search(blocked_addrs, &addr, HASH_FIND, NULL) != NULL);
+				pfree(prosrc);
+			}
+			pfree(probin);
+		}
+	}
+
+	ReleaseSysCache(procTup);
+	return result;
+}
+
+/*
+ * set_user_fmgr_hook
+ *
+ * Called around each call of a function that set_user_needs_fmgr_hook() (or
+ * another extension's hook) asked for. flinfo is the function's own FmgrInfo,
+ * so fn_addr is the address that is about to be called.
+ */
+static void
+set_user_fmgr_hook(FmgrHookEventType event, FmgrInfo *flinfo, Datum *arg)
+{
+	BlockedAddrEntry   *entry;
+
+	if (next_fmgr_hook)
+		(*next_fmgr_hook)(event, flinfo, arg);
+
+	if (event != FHET_START || Block_Method != SET_USER_BLOCK_FMGR)
+		return;
+
+	/* If set_user has been used to transition, enforce the function block. */
+	if (curr_state == NULL || curr_state->userid == InvalidOid)
+		return;
+
+	set_user_cache_builtins();
+
+	entry = (BlockedAddrEntry *) hash_search(blocked_addrs, &flinfo->fn_addr, HASH_FIND, NULL);
+	if (entry != NULL)
+		set_user_report_blocked(flinfo->fn_oid, entry->is_set_config);
 }
@@ -10,6 +10,7 @@ typedef struct SetUserHooks
 } SetUserHooks;
 
 #define SET_USER_HOOKS_KEY	"SetUserHooks"
+#define SET_USER_DEFERRED_HOOKS_KEY	"SetUserDeferredHooks"
 
 /*
  * register_set_user_hooks
@@ -40,4 +41,36 @@ static inline void register_set_user_hooks(void *set_user_hook, void *reset_user
 	MemoryContextSwitchTo(oldcontext);
 }
 
+/*
+ * register_set_user_deferred_hooks
+ *
+ * Like register_set_user_hooks(), but the hooks are called by the set_user
+ * deferred hook worker once the transaction which made the transition has
+ * committed, rather than by the backend during its commit. Each call runs in
+ * a transaction of its own, in set_user.deferred_hook_database, as the session
+ * user of the backend which made the transition, so a hook may write to the
+ * database. An error in a hook rolls back its transaction and is logged; it
+ * cannot affect the transition. Must be called from a library in
+ * shared_preload_libraries, along with set_user itself.
+ */
+static inline void register_set_user_deferred_hooks(void *set_user_hook, void *reset_user_hook)
+{
+	List			  **HooksQueue;
+	SetUserHooks	   *hook_entry;
+	MemoryContext		oldcontext;
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	/* Grab the deferred SetUserHooks queue from the rendezvous hash */
+	HooksQueue = (List **) find_rendezvous_variable(SET_USER_DEFERRED_HOOKS_KEY);
+
+	/* Populate a new hooks entry and append it to the queue */
+	hook_entry = palloc0(sizeof(SetUserHooks));
+	hook_entry->post_set_user = set_user_hook;
+	hook_entry->post_reset_user = reset_user_hook;
+
+	*HooksQueue = lappend(*HooksQueue, hook_entry);
+	MemoryContextSwitchTo(oldcontext);
+}
+
 #endif
@@ -0,0 +1,28 @@
+/*
+ * set_user_fmgr_alias.c
+ *
+ * Test module for the set_user.block_method = fmgr regression run. It exports
+ * set_config_by_name() under another symbol, so a LANGUAGE C function can be
+ * pointed at the builtin. A wrapper would have an address of its own, so the
+ * symbol is a GNU indirect function resolving to the builtin itself.
+ *
+ * Not installed with set_user; see test/test.sh.
+ */
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "utils/fmgrprotos.h"
+
+PG_MODULE_MAGIC;
+
+static PGFunction resolve_set_config_alias(void);
+
+Datum set_config_alias(PG_FUNCTION_ARGS) __attribute__((ifunc("resolve_set_config_alias")));
+
+PG_FUNCTION_INFO_V1(set_config_alias);
+
+static PGFunction
+resolve_set_config_alias(void)
+{
+	return set_config_by_name;
+}
@@ -12,3 +12,14 @@ ${PGBIN}/pg_ctl -w start -D ${PGDATA}
 
 # Test set_user
 make -C /set_user installcheck USE_PGXS=1
+
+# Build and install the test module used by the fmgr block method test
+make -C /set_user/test/fmgr_alias clean all USE_PGXS=1
+sudo bash -c "PATH=${PATH?} make -C /set_user/test/fmgr_alias install USE_PGXS=1"
+
+# Restart postgres with set_user.block_method = fmgr
+echo "set_user.block_method = fmgr" >> ${PGDATA}/postgresql.conf
+${PGBIN}/pg_ctl -w restart -D ${PGDATA}
+
+# Test set_user with the fmgr block method
+make -C /set_user installcheck USE_PGXS=1 REGRESS=set_user_fmgr
@@ -0,0 +1,121 @@
+/* set-user--4.1.0--4.2.0.sql */
+
+SET LOCAL search_path to @extschema@;
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION set_user UPDATE to '4.2.0'" to load this file. \quit
+
+CREATE FUNCTION @extschema@.set_session_auth(text, text)
+RETURNS text
+AS 'MODULE_PATHNAME', 'set_session_auth'
+LANGUAGE C STRICT;
+REVOKE EXECUTE ON FUNCTION @extschema@.set_session_auth(text, text) FROM PUBLIC;
+
+CREATE FUNCTION @extschema@.reset_session_auth(text)
+RETURNS text
+AS 'MODULE_PATHNAME', 'reset_session_auth'
+LANGUAGE C STRICT;
+GRANT EXECUTE ON FUNCTION @extschema@.reset_session_auth(text) TO PUBLIC;
+
+CREATE FUNCTION @extschema@.set_user_rate_limit_stats
+(
+  OUT caller_rejected bigint,
+  OUT target_rejected bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'set_user_rate_limit_stats'
+LANGUAGE C STRICT;
+REVOKE EXECUTE ON FUNCTION @extschema@.set_user_rate_limit_stats() FROM PUBLIC;
+
+CREATE TABLE @extschema@.set_user_job_queue
+(
+  id bigserial PRIMARY KEY,
+  dbname name NOT NULL,
+  rolname name NOT NULL,
+  submitted_by name NOT NULL,
+  command text NOT NULL,
+  status text NOT NULL DEFAULT 'queued',
+  submitted_at timestamptz NOT NULL DEFAULT now(),
+  started_at timestamptz,
+  finished_at timestamptz,
+  error text
+);
+CREATE INDEX set_user_job_queue_queued_idx
+  ON @extschema@.set_user_job_queue (id) WHERE status = 'queued';
+REVOKE ALL ON @extschema@.set_user_job_queue FROM PUBLIC;
+SELECT pg_catalog.pg_extension_config_dump('@extschema@.set_user_job_queue', '');
+SELECT pg_catalog.pg_extension_config_dump('@extschema@.set_user_job_queue_id_seq', '');
+
+CREATE FUNCTION @extschema@.set_user_submit_job(name, name, text)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'set_user_submit_job'
+LANGUAGE C STRICT;
+REVOKE EXECUTE ON FUNCTION @extschema@.set_user_submit_job(name, name, text) FROM PUBLIC;
+
+CREATE FUNCTION @extschema@.set_user_create_lease(text, interval)
+RETURNS text
+AS 'MODULE_PATHNAME', 'set_user_create_lease'
+LANGUAGE C STRICT;
+REVOKE EXECUTE ON FUNCTION @extschema@.set_user_create_lease(text, interval) FROM PUBLIC;
+
+CREATE FUNCTION @extschema@.set_user_attach_lease(text)
+RETURNS text
+AS 'MODULE_PATHNAME', 'set_user_attach_lease'
+LANGUAGE C STRICT;
+GRANT EXECUTE ON FUNCTION @extschema@.set_user_attach_lease(text) TO PUBLIC;
+
+CREATE FUNCTION @extschema@.set_user_check
+(
+  IN callers text[],
+  IN targets text[],
+  OUT caller text,
+  OUT target text,
+  OUT allowed boolean,
+  OUT detail text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'set_user_check'
+LANGUAGE C STRICT;
+REVOKE EXECUTE ON FUNCTION @extschema@.set_user_check(text[], text[]) FROM PUBLIC;
+
+CREATE TABLE @extschema@.set_user_audit_log
+(
+  event_time timestamptz NOT NULL,
+  backend_pid integer NOT NULL,
+  session_role name NOT NULL,
+  acting_role name NOT NULL,
+  event_type text NOT NULL,
+  target_role name,
+  escalation_id bigint,
+  command_tag text,
+  statement text
+);
+REVOKE ALL ON @extschema@.set_user_audit_log FROM PUBLIC;
+SELECT pg_catalog.pg_extension_config_dump('@extschema@.set_user_audit_log', '');
+
+/* Each SQL function now has a C entry point of its own */
+
+CREATE OR REPLACE FUNCTION @extschema@.set_user(text)
+RETURNS text
+AS 'MODULE_PATHNAME', 'set_user_role'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION @extschema@.set_user(text, text)
+RETURNS text
+AS 'MODULE_PATHNAME', 'set_user_role'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION @extschema@.reset_user()
+RETURNS text
+AS 'MODULE_PATHNAME', 'reset_user'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION @extschema@.reset_user(text)
+RETURNS text
+AS 'MODULE_PATHNAME', 'reset_user'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION @extschema@.set_user_u(text)
+RETURNS text
+AS 'MODULE_PATHNAME', 'set_user_u'
+LANGUAGE C STRICT;